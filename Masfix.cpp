@@ -1,24 +1,43 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 namespace fs = std::filesystem;
 
 #include <string>
+#include <cstring>
 #include <map>
 #include <set>
 #include <vector>
 #include <list>
 #include <stack>
+#include <deque>
 #include <optional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
 
 #include <algorithm>
 #include <numeric>
 #include <math.h>
+#include <time.h>
 #include <assert.h>
 #include <functional>
 #include <cctype>
 #include <locale>
 #include <utility>
+#include <limits>
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 using namespace std;
 
 // constants -------------------------------
@@ -29,8 +48,9 @@ using namespace std;
 #define STDOUT_BUFF_SIZE 256
 #define STDIN_BUFF_SIZE 256
 
-#define WORD_MAX_VAL 65535
+#define WORD_MAX_VAL 65535 // of the default 16-bit words, see wordMaxVal()
 #define CELLS WORD_MAX_VAL+1
+#define STACK_PTR_CELL 0 // G_STACK_PTR of std, used by spsh/spop
 // enums --------------------------------
 enum TokenTypes {
 	Tnumeric,
@@ -58,10 +78,11 @@ const set<string> DefiningDirectivesSet = {
 	"macro",
 	"namespace"
 };
-constexpr int BuiltinDirectivesCount = 2;
+constexpr int BuiltinDirectivesCount = 3;
 const set<string> BuiltinDirectivesSet = {
 	"using",
-	"include"
+	"include",
+	"static"
 };
 enum RegNames {
 	Rh,
@@ -83,6 +104,8 @@ enum OpNames {
 	OPa,
 	OPs,
 	OPt,
+	OPd,
+	OPo,
 
 	OPand, // bitwise
 	OPor,
@@ -95,11 +118,13 @@ enum OpNames {
 	OPno,
 	OperationCount
 };
-static_assert(OperationCount == 10, "Exhaustive CharToOp definition");
+static_assert(OperationCount == 12, "Exhaustive CharToOp definition");
 map<char, OpNames> CharToOp = {
 {'a', OPa}, // TODO: add +, - as suffixes
 {'s', OPs},
 {'t', OPt},
+{'d', OPd},
+{'o', OPo},
 
 {'&', OPand},
 {'|', OPor},
@@ -150,6 +175,10 @@ enum InstrNames {
 	Is,
 
 	Iswap,
+	Ifill,
+	Icopy,
+	Ispsh,
+	Ispop,
 	Ioutu,
 	Ioutc,
 	Iinc,
@@ -158,7 +187,7 @@ enum InstrNames {
 	Iinl,
 	InstructionCount
 };
-static_assert(InstructionCount == 14, "Exhaustive StrToInstr definition");
+static_assert(InstructionCount == 18, "Exhaustive StrToInstr definition");
 map<string, InstrNames> StrToInstr {
 {"mov", Imov},
 {"str", Istr},
@@ -170,6 +199,10 @@ map<string, InstrNames> StrToInstr {
 {"s", Is},
 
 {"swap", Iswap},
+{"fill", Ifill},
+{"copy", Icopy},
+{"spsh", Ispsh},
+{"spop", Ispop},
 {"outu", Ioutu},
 {"outc", Ioutc},
 {"inc", Iinc},
@@ -201,6 +234,26 @@ struct Loc {
 		return file + ":" + to_string(row) + ":" + to_string(col);
 	}
 };
+/// token allocations of the current thread, reported by --time-report
+struct TokenStats {
+	static inline bool enabled = false; // counted only for --time-report, set before any compilation starts
+	unsigned long long created = 0;
+	long long live = 0;
+	long long peakLive = 0;
+
+	void add() {
+		created++;
+		peakLive = max(peakLive, ++live);
+	}
+	/// takes over tokens allocated by another thread
+	void adopt(unsigned long long otherCreated, long long otherLive) {
+		created += otherCreated;
+		live += otherLive;
+		peakLive = max(peakLive, live);
+	}
+};
+thread_local TokenStats tokenStats;
+
 struct Token {
 	TokenTypes type=TokenCount;
 	string data; // contains only data - no quotes, quotes added when mentioning in error
@@ -209,10 +262,11 @@ struct Token {
 	Loc loc;
 	bool continued; // continues meaning of previous token
 	bool firstOnLine;
+	int expansionId = -1; // macro expansion whose body contains the token, -1 if none
 
 	//–– construtors
-    Token() = default;
-    ~Token() = default; // TODO destructor?
+    Token() { if (TokenStats::enabled) tokenStats.add(); }
+    ~Token() { if (TokenStats::enabled) tokenStats.live--; }
 
 	Token(TokenTypes type, string data, Loc loc, bool continued, bool firstOnLine) {
 		this->type = type;
@@ -220,9 +274,12 @@ struct Token {
 		this->loc = loc;
 		this->continued = continued;
 		this->firstOnLine = firstOnLine;
+		if (TokenStats::enabled) tokenStats.add();
 	}
 	static Token fromCtx(TokenTypes type, string data, Token const& ctx) {
-		return Token(type, move(data), ctx.loc, ctx.continued, ctx.firstOnLine);
+		Token token(type, move(data), ctx.loc, ctx.continued, ctx.firstOnLine);
+		token.expansionId = ctx.expansionId;
+		return token;
 	}
 	//–– Copy
 	Token(const Token& other)
@@ -232,7 +289,8 @@ struct Token {
 		, loc(other.loc)
 		, continued(other.continued)
 		, firstOnLine(other.firstOnLine)
-	{}
+		, expansionId(other.expansionId)
+	{ if (TokenStats::enabled) tokenStats.add(); }
 	Token& operator=(const Token& other) {
 		if (this != &other) {
 			type = other.type;
@@ -241,6 +299,7 @@ struct Token {
 			loc = other.loc;
 			continued = other.continued;
 			firstOnLine = other.firstOnLine;
+			expansionId = other.expansionId;
 		}
 		return *this;
 	}
@@ -252,7 +311,8 @@ struct Token {
 		, loc(std::move(other.loc))
 		, continued(other.continued)
 		, firstOnLine(other.firstOnLine)
-	{}
+		, expansionId(other.expansionId)
+	{ if (TokenStats::enabled) tokenStats.add(); }
 	Token& operator=(Token&& other) noexcept {
 	  if (this != &other) {
 		type = std::exchange(other.type, TokenCount);
@@ -261,6 +321,7 @@ struct Token {
 		loc = std::move(other.loc);
 		continued = other.continued;
 		firstOnLine = other.firstOnLine;
+		expansionId = other.expansionId;
 	  }
 	  return *this;
 	}
@@ -381,8 +442,6 @@ struct Namespace {
 	}
 };
 
-map<int, Namespace> IdToNamespace;
-
 struct Module {
 	fs::path abspath;
 	Token contents; // TImodule
@@ -413,24 +472,25 @@ struct Suffix {
 struct Instr {
 	InstrNames instr = InstructionCount;
 	Suffix suffixes;
-	int immediate;
+	long long immediate;
 
 	string opcodeStr;
 	Loc opcodeLoc;
 	list<Token> immediates;
 
 	bool needsReparsing = false; // references smth which might change
+	int expansionId = -1; // innermost macro expansion which produced the instr
 
 	Instr() {}
 	Instr(Loc opcodeLoc) {
 		this->opcodeStr = opcodeStr;
 		this->opcodeLoc = opcodeLoc;
 	}
-	bool hasImm() { return !immediates.empty(); }
-	bool hasCond() { return suffixes.cond != Cno; }
-	bool hasMod()  { return suffixes.modifier != OPno; }
-	bool hasReg()  { return suffixes.reg != Rno; }
-	bool hasOp()  { return suffixes.op != OPno; }
+	bool hasImm() const { return !immediates.empty(); }
+	bool hasCond() const { return suffixes.cond != Cno; }
+	bool hasMod() const { return suffixes.modifier != OPno; }
+	bool hasReg() const { return suffixes.reg != Rno; }
+	bool hasOp() const { return suffixes.op != OPno; }
 
 	string toStr() {
 		string out = opcodeStr;
@@ -455,17 +515,60 @@ struct Label {
 		return ":" + name;
 	}
 };
+/// macro expansion which produced instructions
+struct ExpansionFrame {
+	int parent; // enclosing expansion, -1 if none
+	string name;
+	Loc loc; // of the macro use
+	Loc defLoc; // of the macro definition
+	int tokens; // produced by this expansion, without the nested ones
+	bool ctime; // inside a ctime expansion, its code doesn't reach the program
+
+	ExpansionFrame(int parent, string name, Loc loc, Loc defLoc, int tokens, bool ctime) {
+		this->parent = parent;
+		this->name = name;
+		this->loc = loc;
+		this->defLoc = defLoc;
+		this->tokens = tokens;
+		this->ctime = ctime;
+	}
+	string toStr() {
+		return '%' + name + ' ' + loc.toStr();
+	}
+};
 struct ParseCtx {
 	vector<Instr> instrs;
 	size_t parseStartIdx;
+	vector<ExpansionFrame> expansions;
 	map<string, Label> strToLabel;
+	map<unsigned, unsigned> data; // initial memory placed by %static
+	long long dataCursor = -1; // right after the last named %static
 	Module* lastModule = nullptr;
+	fs::path mainPath;
+	map<string, fs::path> moduleFiles; // Loc file -> absolute path
 	optional<ofstream> dumpFile;
 	vector<int> instrsToReparse; // reparsed every time ~ bcs using end label
 
 	void close() {
 		if (!!dumpFile) dumpFile->close();
 	}
+	/// registers the expansion as a child of the one containing the macro use
+	/// and marks the copied body tokens as produced by it
+	void addExpansion(Token& expansion, Loc defLoc) {
+		int id = expansions.size(), tokens = 0;
+		stack<list<Token>*> tlists;
+		tlists.push(&expansion.tlist);
+		while (tlists.size()) {
+			list<Token>& tlist = *tlists.top(); tlists.pop();
+			for (Token& token : tlist) {
+				token.expansionId = id; tokens++;
+				if (token.tlist.size()) tlists.push(&token.tlist);
+			}
+		}
+		int parent = expansion.expansionId;
+		bool ctime = expansion.type == TIctime || (parent != -1 && expansions[parent].ctime);
+		expansions.push_back(ExpansionFrame(parent, expansion.data, expansion.loc, defLoc, tokens, ctime));
+	}
 	void removeCtimeInstrs() {
 		instrs.resize(parseStartIdx);
 		while (instrsToReparse.size() && instrsToReparse[instrsToReparse.size()-1] >= instrs.size()) {
@@ -473,23 +576,108 @@ struct ParseCtx {
 		}
 	}
 };
-ParseCtx parseCtx;
+#ifdef _WIN32
+const size_t LAZY_COMMIT_CHUNK = 1 << 16; // allocation granularity, reservations are aligned to it
+/// reserved regions of allocLazyZeroed, committed chunk by chunk on the first touch
+struct LazyRegions {
+	mutex lock;
+	vector<pair<char*, size_t>> regions; // start, bytes
+};
+LazyRegions& lazyRegions() {
+	static LazyRegions lazy;
+	return lazy;
+}
+/// vectored exception handler committing the touched chunk of a lazy region
+LONG CALLBACK commitLazyZeroed(EXCEPTION_POINTERS* info) {
+	EXCEPTION_RECORD* record = info->ExceptionRecord;
+	if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2) return EXCEPTION_CONTINUE_SEARCH;
+	char* addr = (char*)record->ExceptionInformation[1];
+	LazyRegions& lazy = lazyRegions();
+	lock_guard<mutex> guard(lazy.lock);
+	for (auto [start, bytes] : lazy.regions) {
+		if (addr < start || addr >= start + bytes) continue;
+		char* chunk = start + (addr - start) / LAZY_COMMIT_CHUNK * LAZY_COMMIT_CHUNK;
+		if (!VirtualAlloc(chunk, min<size_t>(LAZY_COMMIT_CHUNK, start + bytes - chunk), MEM_COMMIT, PAGE_READWRITE)) break;
+		return EXCEPTION_CONTINUE_EXECUTION;
+	}
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+#endif
+/// reserves zeroed memory, its pages are backed only once touched
+void* allocLazyZeroed(size_t bytes) {
+#ifdef _WIN32
+	static bool handlerAdded = AddVectoredExceptionHandler(1, commitLazyZeroed) != nullptr;
+	void* ptr = VirtualAlloc(nullptr, bytes, MEM_RESERVE, PAGE_READWRITE);
+	if (!handlerAdded || !ptr) throw bad_alloc();
+	LazyRegions& lazy = lazyRegions();
+	lock_guard<mutex> guard(lazy.lock);
+	lazy.regions.push_back({(char*)ptr, bytes});
+#else
+	void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED) throw bad_alloc();
+#endif
+	return ptr;
+}
+/// zeroes the memory by dropping its touched pages
+void resetLazyZeroed(void* ptr, size_t bytes) {
+#ifdef _WIN32
+	VirtualFree(ptr, bytes, MEM_DECOMMIT); // committed again once touched
+#else
+	madvise(ptr, bytes, MADV_DONTNEED);
+#endif
+}
+void freeLazyZeroed(void* ptr, size_t bytes) {
+#ifdef _WIN32
+	LazyRegions& lazy = lazyRegions();
+	{
+		lock_guard<mutex> guard(lazy.lock);
+		lazy.regions.erase(remove_if(lazy.regions.begin(), lazy.regions.end(), [&](auto& region) { return region.first == ptr; }), lazy.regions.end());
+	}
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, bytes);
+#endif
+}
 /// structure simulating the virtual machine during interpretation
-struct VM {
-	unsigned short head;
-	unsigned short reg;
-	unsigned short ip;
-	unsigned short mem[CELLS];
-
-	VM() {};
-	void start(unsigned short startIdx) {
+/// - Word is the machine word, there is a memory cell for each of its values
+/// - reusable between runs, reset keeps the memory allocated
+template<typename Word>
+struct BasicVM {
+	static constexpr size_t CELL_COUNT = (size_t)numeric_limits<Word>::max() + 1;
+	Word head;
+	Word reg;
+	Word ip;
+	Word* mem; // lazily backed, untouched cells cost only address space
+
+	istream* in = &cin; // stdin of the program
+	ostream* out = &cout; // stdout of the program
+	unsigned long long steps = 0; // executed instructions since reset
+
+	BasicVM() : head(0), reg(0), ip(0), mem((Word*)allocLazyZeroed(CELL_COUNT * sizeof(Word))) {};
+	BasicVM(BasicVM const&) = delete;
+	~BasicVM() {
+		freeLazyZeroed(mem, CELL_COUNT * sizeof(Word));
+	}
+	void start(size_t startIdx) {
  		ip = startIdx;
 	}
-	unsigned short& cell() {
+	void reset() {
+		head = 0;
+		reg = 0;
+		ip = 0;
+		steps = 0;
+		resetLazyZeroed(mem, CELL_COUNT * sizeof(Word));
+	}
+	/// writes the initial memory of a program
+	void load(map<unsigned, unsigned> const& data) {
+		for (auto [addr, value] : data) mem[addr] = value;
+	}
+	Word& cell() {
 		return mem[head];
 	}
 };
-VM globalVm;
+typedef BasicVM<unsigned short> VM;
+typedef BasicVM<unsigned int> VM32; // --word-bits 32
 /// holds all compile time flags and settings
 struct Flags {
 	bool verbose = false;
@@ -497,18 +685,144 @@ struct Flags {
 	bool keepAsm = false;
 	bool dump = false;
 	bool interpret = false;
+	bool serve = false;
+	bool watch = false;
+	bool profile = false;
+	bool memoryReport = false;
+	vector<pair<string, size_t>> segments; // --segments starts, empty for MEMORY_LAYOUT of std
+	bool instrument = false;
+	fs::path profileUse = "";
+	bool debugInfo = false;
+	bool debugInline = false;
+	bool timeReport = false;
+	bool expansionReport = false;
+	bool timeReportJson = false;
+	fs::path countsReport = "";
+	int outline = 0; // min outlined sequence length, 0 if disabled
+	bool stripDead = false;
+	bool preinit = false;
+	int wordBits = 16; // 16 / 32
+	int jobs = 0;
+	bool prefetch = true;
+
+	bool strictErrors = false;
+	bool enableWarnings = true;
+	bool enableNotes = true;
 
 	fs::path inputPath = "";
+	vector<fs::path> batchPaths;
 	vector<fs::path> includeFolders;
 
 	fs::path filePath(string fileExt) {
 		return inputPath.replace_extension(fileExt);
 	}
+	/// whether some output attributes code to macro expansions
+	bool tracksExpansions() {
+		return expansionReport || debugInfo || profile || instrument || !countsReport.empty();
+	}
 	string filePathStr(string fileExt) {
 		return '"' + filePath(fileExt).string() + '"';
 	}
 };
-Flags flags;
+/// wall & CPU time of --time-report phases and modules, exclusive of nested phases
+struct PhaseTimes {
+	double wall = 0;
+	double cpu = 0; // of the compiling thread, external commands excluded
+	unsigned long long calls = 0;
+};
+struct TimeReport {
+	map<string, PhaseTimes> phases;
+	map<string, PhaseTimes> modules; // tokenization & parsing of each module
+	unsigned long long macroExpansions = 0;
+	unsigned long long ctimeRuns = 0;
+	unsigned long long ctimeSteps = 0;
+	unsigned long long runSteps = 0;
+	unsigned long long threadedJumps = 0;
+};
+/// state of a single compilation
+/// - each compiling thread works on its own one, accessible through comp
+struct Compilation {
+	Flags flags;
+	ParseCtx parseCtx;
+	map<int, Namespace> namespaces;
+	VM vm; // ctime VM, also runtime VM when interpreting
+	unique_ptr<VM32> vm32; // replaces vm with --word-bits 32
+	vector<string> errors;
+	bool supressErrors = false;
+	TimeReport times;
+
+	ostream* out = &cout; // compiler messages
+	ostream* err = &cerr; // compilation errors
+
+	Compilation(Flags flags) {
+		this->flags = flags;
+		tokenStats.created = 0;
+		tokenStats.peakLive = tokenStats.live;
+	}
+	/// calls f with the VM of the target word size
+	template<typename F>
+	auto withVM(F f) {
+		if (flags.wordBits == 32) {
+			if (!vm32) {
+				vm32 = make_unique<VM32>();
+				vm32->in = vm.in;
+				vm32->out = vm.out;
+			}
+			return f(*vm32);
+		}
+		return f(vm);
+	}
+	/// largest word value of the target
+	unsigned long long wordMaxVal() {
+		return flags.wordBits == 32 ? numeric_limits<unsigned>::max() : WORD_MAX_VAL;
+	}
+};
+thread_local Compilation* comp = nullptr;
+
+double threadCpuSeconds() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+/// measures a phase of --time-report while in scope, pauses the enclosing phase
+struct PhaseTimer {
+	static thread_local vector<PhaseTimer*> running;
+	PhaseTimes* phase = nullptr;
+	PhaseTimes* module = nullptr;
+	chrono::steady_clock::time_point wallStart;
+	double cpuStart;
+
+	PhaseTimer(string phaseName, string moduleName="") {
+		if (!comp || !comp->flags.timeReport) return;
+		if (running.size()) running.back()->pause();
+		phase = &comp->times.phases[phaseName];
+		if (moduleName != "") module = &comp->times.modules[moduleName];
+		phase->calls++;
+		if (module) module->calls++;
+		running.push_back(this);
+		resume();
+	}
+	~PhaseTimer() {
+		if (!phase) return;
+		pause();
+		running.pop_back();
+		if (running.size()) running.back()->resume();
+	}
+	void resume() {
+		wallStart = chrono::steady_clock::now();
+		cpuStart = threadCpuSeconds();
+	}
+	void pause() {
+		double wall = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+		double cpu = threadCpuSeconds() - cpuStart;
+		for (PhaseTimes* times : {phase, module}) {
+			if (!times) continue;
+			times->wall += wall;
+			times->cpu += cpu;
+		}
+	}
+};
+thread_local vector<PhaseTimer*> PhaseTimer::running;
 
 // checks --------------------------------------------------------------------
 #define unreachable() assert(("Unreachable", false));
@@ -520,39 +834,37 @@ Flags flags;
 #define checkContinueOnFail(cond, ...) continueOnFalse(check(cond, __VA_ARGS__));
 #define checkReturnOnFail(cond, ...) returnOnFalse(check(cond, __VA_ARGS__));
 
-bool FLAG_strictErrors = false;
-bool FLAG_enableWarnings = true;
-bool FLAG_enableNotes = true;
-bool SupressErrors = false;
-
-#define returnOnErrSupress() if (SupressErrors) return false;
-#define returnOnWarningSupress() if (SupressErrors || !FLAG_enableWarnings) return false;
+#define returnOnErrSupress() if (comp->supressErrors) return false;
+#define returnOnWarningSupress() if (comp->supressErrors || !comp->flags.enableWarnings) return false;
 
 string errorQuoted(string s) {
 	if (s.at(0) == '\'' || s.at(0) == '"') return ' ' + s;
 	return " '" + s + "'";
 }
 
-vector<string> errors;
+/// thrown when the compilation can't continue, the driver decides whether to exit
+struct CompilationFailed {
+	int exitCode;
+};
 void raiseErrors() { // TODO sort errors based on line and file
-	for (string s : errors) {
-		cerr << s;
+	for (string s : comp->errors) {
+		*comp->err << s;
 	}
-	if (errors.size()) {
-		exit(1);
+	if (comp->errors.size()) {
+		throw CompilationFailed{1};
 	}
-	cout.flush();
-	cerr.flush();
+	comp->out->flush();
+	comp->err->flush();
 }
 void addError(string message, bool strict=true) {
-	errors.push_back(message);
-	if (strict || FLAG_strictErrors) {
+	comp->errors.push_back(message);
+	if (strict || comp->flags.strictErrors) {
 		raiseErrors();
 	}
 }
 
 void _raiseNote(string message) {
-	if (!FLAG_enableNotes) return;
+	if (!comp->flags.enableNotes) return;
 	string err = "    - NOTE: " + message + "\n";
 	addError(err, false);
 }
@@ -593,6 +905,18 @@ bool raiseWarning(string message, Loc loc, string note="") {
 }
 // struct Scope --------------------------------------------------------
 void interpret(int startIdx=0);
+struct ModuleLoader;
+/// identity of an existing file, equal for all paths leading to it
+/// - device & inode, canonical path on Windows
+string fileIdentity(fs::path path) {
+#ifndef _WIN32
+	struct stat info;
+	if (stat(path.c_str(), &info) == 0) return to_string(info.st_dev) + ':' + to_string(info.st_ino);
+#endif
+	return fs::canonical(path).string();
+}
+/// rest of a directive, run once its arglist is preprocessed
+typedef function<bool()> Continuation;
 
 /// responsible for iterating tokens and nested tlists,
 /// keeping track of current module, namespace, expansion scope, arglist situation
@@ -605,7 +929,15 @@ private:
 	stack<list<Token>::iterator> itrs;
 	list<Module> modules;
 	list<Module>::iterator currModule = modules.begin();
+	map<string, int> moduleNamespaces; // module fileIdentity -> namespace id
+	map<fs::path, string> identities; // fileIdentity cache
 	bool isPreprocessing = true;
+	/// directive waiting for its arglist to be preprocessed
+	struct SuspendedDirective {
+		Continuation resume;
+		bool errorLess = true; // of the arglist contents
+	};
+	stack<SuspendedDirective> suspended; // preprocess() work stack, replaces recursion into nested arglists
 	
 	/// opens new tlist for iteration
 	void openList(Token& tlist) {
@@ -634,6 +966,7 @@ private:
 	}
 
 public:
+	ModuleLoader* loader = nullptr; // of the compilation, resolves & prefetches included modules
 	Scope() {}
 	list<Token>& currList() {
 		return tlists.top().get().tlist;
@@ -654,6 +987,12 @@ public:
 	bool hasNext() {
 		return itrs.top() != currList().end();
 	}
+	/// token after the current one in currList, nullptr if none
+	Token* peekNext() {
+		if (!hasNext()) return nullptr;
+		list<Token>::iterator following = std::next(itrs.top());
+		return following != currList().end() ? &*following : nullptr;
+	}
 	/// closes ended tlists if necessary
 	/// - generally closes only basic tlist types, special ones are left open for respective funcs to handle
 	/// @returns if iteration can meaningfully continue in current situation
@@ -696,7 +1035,7 @@ public:
 		itrs.top()->firstOnLine = percentToken.firstOnLine;
 	}
 	Token eatenToken() {
-		Token t = currToken();
+		Token t = move(currToken()); // NOTE moved, nested tlists would be deep copied
 		itrs.top() = currList().erase(itrs.top());
 		return t;
 	}
@@ -726,10 +1065,10 @@ public:
 		return insideMacro() ? macros.top().first : namespaces.top();
 	}
 	Namespace& currNamespace() {
-		return IdToNamespace[currNamespaceId()];
+		return comp->namespaces[currNamespaceId()];
 	}
 	Namespace& topNamespace() {
-		return IdToNamespace[namespaces.top()];
+		return comp->namespaces[namespaces.top()];
 	}
 	Macro& currMacro() {
 		assert(insideMacro());
@@ -743,6 +1082,7 @@ public:
 	}
 	/// adds macro expansion to macro scoping stack
 	void addMacroExpansion(int namespaceId, Token& expansionToken) {
+		comp->times.macroExpansions++;
 		if (macros.size() > MAX_EXPANSION_DEPTH) { // TODO?
 			raiseError("Maximum expansion depth exceeded", expansionToken.loc, "", true);
 		}
@@ -755,12 +1095,12 @@ public:
 	}
 	int addNewNamespace(string& name, Loc loc, bool isModuleDefinition) {
 		assert(!insideMacro());
-		int newId = IdToNamespace.size();
+		int newId = comp->namespaces.size();
 		if (newId != 0) {
 			if (isModuleDefinition) currNamespace().usedNamespaces.insert(newId);
 			else currNamespace().innerNamespaces[name] = newId;
 		}
-		IdToNamespace[newId] = Namespace(name, loc, isModuleDefinition ? -1 : currNamespaceId(), !isModuleDefinition);
+		comp->namespaces[newId] = Namespace(name, loc, isModuleDefinition ? -1 : currNamespaceId(), !isModuleDefinition);
 		namespaces.push(newId);
 		return newId;
 	}
@@ -776,6 +1116,29 @@ public:
 		assert(insideTlistOfType(TIarglist));
 		closeList();
 	}
+	/// opens tlist as an arglist and suspends the directive until preprocess() finishes it
+	/// - the arglist is exited before resuming, `then` runs only if it was errorless
+	/// - must be the directive's last action, @returns true
+	bool preprocessArglist(Token& tlist, Continuation then) {
+		enterArglist(tlist);
+		suspended.push(SuspendedDirective{move(then)});
+		return true;
+	}
+	bool hasSuspended() {
+		return suspended.size();
+	}
+	/// errorless flag of the innermost suspended directive's arglist
+	bool& suspendedErrorLess() {
+		return suspended.top().errorLess;
+	}
+	/// exits the finished arglist of the innermost suspended directive
+	/// @returns its continuation, nullptr if the arglist had errors
+	Continuation resumeSuspended() {
+		exitArglist(); // NOTE before popping, the continuation may own the arglist
+		Continuation then = suspended.top().errorLess ? move(suspended.top().resume) : nullptr;
+		suspended.pop();
+		return then;
+	}
 // tokenization -----------------------------------------
 	bool tokenizeHasTlist() {
 		return tlists.size() && insideTlistOfType(Tlist);
@@ -800,27 +1163,44 @@ public:
 	Module* getCurrModule() {
 		return &*currModule;
 	}
+	string moduleIdentity(fs::path abspath) {
+		if (!identities.count(abspath)) identities[abspath] = fileIdentity(abspath);
+		return identities[abspath];
+	}
 	bool newModuleIncluded(fs::path abspath) {
-		for (list<Module>::iterator module = modules.begin(); module != modules.end(); ++module) {
-			if (fs::equivalent(module->abspath, abspath)) {
-				currNamespace().usedNamespaces.insert(module->namespaceId);
-				return false;
-			}
-		}
-		return true;
+		map<string, int>::iterator module = moduleNamespaces.find(moduleIdentity(abspath));
+		if (module == moduleNamespaces.end()) return true;
+		currNamespace().usedNamespaces.insert(module->second);
+		return false;
 	}
 	void addNewModule(fs::path abspath, string relPath, string moduleName) {
 		Loc loc = Loc(relPath, 1, 1);
 		int namespaceId = addNewNamespace(moduleName, loc, true);
+		moduleNamespaces[moduleIdentity(abspath)] = namespaceId;
 		currModule = modules.insert(currModule, Module(abspath, namespaceId));
 		currModule->contents = Token(TImodule, moduleName, loc, false, true);
 		openList(currModule->contents);
 	}
+	/// fills the freshly added module with already tokenized contents
+	void loadModuleTokens(list<Token> tokens) {
+		assert(insideTlistOfType(TImodule));
+		currList() = move(tokens);
+		itrs.top() = currList().begin();
+	}
+	list<Token>& currModuleTokens() {
+		return currModule->contents.tlist;
+	}
+	vector<fs::path> modulePaths() {
+		vector<fs::path> paths;
+		for (Module& module : modules) paths.push_back(module.abspath);
+		return paths;
+	}
 
 	bool forceParseImpl();
 	/// Scope wrapper for parsing, returns Scope to same state afterwards
 	/// - used for parsing either whole TImodule or only ctime body
 	bool forceParse(Token& tlist) {
+		PhaseTimer timer("parse", tlist.type == TImodule ? currModule->contents.loc.file : "");
 		assert(isPreprocessing);
 		isPreprocessing = false;
 		int numTlistsBefore = tlists.size();
@@ -837,17 +1217,19 @@ public:
 	/// parses ctime body, runs the VM, handles ctime's return value(s) 
 	void parseInterpretCtime(Token& ctimeExp) {
 		bool safeToRun = forceParse(ctimeExp);
-		int retval = 0;
+		long long retval = 0;
 		if (safeToRun) {
-			interpret(parseCtx.parseStartIdx);
-			retval = globalVm.reg;
+			PhaseTimer timer("ctime");
+			comp->times.ctimeRuns++;
+			interpret(comp->parseCtx.parseStartIdx);
+			retval = comp->withVM([](auto& vm) { return (long long)vm.reg; });
 		}
 		_updateTSafterCtime(ctimeExp, retval);
 		endMacroExpansion();
-		parseCtx.removeCtimeInstrs();
+		comp->parseCtx.removeCtimeInstrs();
 	}
 	/// removes ctime from token stream, inserts it's return value(s)
-	void _updateTSafterCtime(Token& ctimeExp, int retval) {
+	void _updateTSafterCtime(Token& ctimeExp, long long retval) {
 		Token retValToken = Token::fromCtx(Tnumeric, to_string(retval), ctimeExp);
 		// return itr to ctime expansion to remove it
 		assert(&*--itrs.top() == &ctimeExp);	
@@ -1010,12 +1392,12 @@ bool checkIdentRedefinitions(Scope& scope, string name, Loc& loc, bool label, Na
 	checkReturnOnFail(verifyNotInstrOpcode(name), "Name shadows an instruction" + errorQuoted(name), loc);
 	checkReturnOnFail(!DefiningDirectivesSet.count(name) && !BuiltinDirectivesSet.count(name), "Name shadows a builtin directive" + errorQuoted(name), loc)
 	if (label) {
-		checkReturnOnFail(parseCtx.strToLabel.count(name) == 0, "Label redefinition" + errorQuoted(name), loc, noteWhereDefined(loc, parseCtx.strToLabel[name].loc));
+		checkReturnOnFail(comp->parseCtx.strToLabel.count(name) == 0, "Label redefinition" + errorQuoted(name), loc, noteWhereDefined(loc, comp->parseCtx.strToLabel[name].loc));
 	} else {
 		assert(currNamespace);
 		checkReturnOnFail(currNamespace->defines.count(name) == 0, "Define redefinition" + errorQuoted(name), loc, noteWhereDefined(loc, currNamespace->defines[name].loc));
 		checkReturnOnFail(currNamespace->macros.count(name) == 0, "Macro redefinition" + errorQuoted(name), loc, noteWhereDefined(loc, currNamespace->macros[name].loc));
-		checkReturnOnFail(currNamespace->innerNamespaces.count(name) == 0, "Namespace redefinition" + errorQuoted(name), loc, noteWhereDefined(loc, IdToNamespace[currNamespace->innerNamespaces[name]].loc));
+		checkReturnOnFail(currNamespace->innerNamespaces.count(name) == 0, "Namespace redefinition" + errorQuoted(name), loc, noteWhereDefined(loc, comp->namespaces[currNamespace->innerNamespaces[name]].loc));
 		int namespaceId = scope.currNamespaceId();
 		if (lookupNamespaceAbove(name, namespaceId, loc, true)) {
 			raiseWarning("Definition shadowing existing namespace" + errorQuoted(name), loc);
@@ -1073,20 +1455,220 @@ string relPathFromMasfix(fs::path p) {
 	}
 	return (out.empty() ? p : out).string();
 }
+/// tokenized module contents kept between compilations in resident modes
+struct CachedModule {
+	fs::file_time_type mtime;
+	list<Token> tokens;
+};
+map<fs::path, CachedModule> moduleCache; // shared by all compilations
+mutex moduleCacheMutex;
+bool useModuleCache = false;
+
 ifstream openInputFile(fs::path path);
+/// resolves included modules and tokenizes them ahead of time on worker threads
+/// - include path resolutions are cached for the compilation
+/// - every loaded module is scanned for %include "..." and the modules are queued,
+/// 	the one needed next is tokenized on the compiling thread if no worker started it yet
+/// - prefetched tokens are used only if tokenized without errors,
+/// 	otherwise the module is tokenized again when included, to report errors in order
+struct ModuleLoader {
+	enum PrefetchState {
+		PSqueued,
+		PSrunning,
+		PSdone,
+		PStaken, // loaded by the compiling thread
+	};
+	struct Prefetch {
+		PrefetchState state = PSqueued;
+		list<Token> tokens;
+		bool errorLess = false;
+		unsigned long long tokensCreated = 0;
+		long long tokensLive = 0;
+	};
+	Flags flags;
+	bool prefetching;
+	mutex lock; // guards all below
+	condition_variable changed;
+	map<pair<fs::path, string>, fs::path> resolved; // (including module folder, include string) -> canonical path, empty if not found
+	map<fs::path, Prefetch> prefetches;
+	deque<fs::path> queued;
+	vector<thread> workers;
+	bool stopping = false;
+
+	ModuleLoader(Flags& flags, bool prefetching) : flags(flags), prefetching(prefetching) {}
+	~ModuleLoader() {
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		changed.notify_all();
+		for (thread& worker : workers) worker.join();
+	}
+
+	/// canonical path of the included module, empty if not found
+	/// - relative to the including module, then in the include folders
+	fs::path resolve(string str, fs::path moduleFolder) {
+		{
+			lock_guard<mutex> guard(lock);
+			if (resolved.count(pair(moduleFolder, str))) return resolved[pair(moduleFolder, str)];
+		}
+		fs::path path = fs::path(str), found;
+		if (!path.has_extension() || path.extension() == ".mx") {
+			fs::path moduleRel = moduleFolder / path.replace_extension(".mx");
+			if (fs::exists(moduleRel)) found = fs::canonical(moduleRel);
+			else for (fs::path prepath : flags.includeFolders) {
+				path = prepath / fs::path(str).replace_extension(".mx");
+				if (fs::exists(path)) {
+					found = fs::canonical(path);
+					break;
+				}
+			}
+		}
+		lock_guard<mutex> guard(lock);
+		resolved[pair(moduleFolder, str)] = found;
+		return found;
+	}
+	/// queues modules included by tokens of the module in moduleFolder
+	void prefetchIncludes(list<Token>& tokens, fs::path moduleFolder) {
+		static_assert(TokenCount == 13, "Exhaustive prefetchIncludes definition");
+		if (!prefetching) return;
+		vector<list<Token>*> tlists = {&tokens}; // includes can be nested in namespaces
+		while (tlists.size()) {
+			list<Token>& tlist = *tlists.back(); tlists.pop_back();
+			for (list<Token>::iterator token = tlist.begin(); token != tlist.end(); ++token) {
+				if (token->type == Tlist) tlists.push_back(&token->tlist);
+				if (token->type != Tspecial || token->data != "%") continue;
+				list<Token>::iterator name = std::next(token);
+				if (name == tlist.end() || name->type != Talpha || name->data != "include" || !name->continued) continue;
+				list<Token>::iterator str = std::next(name);
+				if (str == tlist.end() || str->type != Tstring) continue;
+				try {
+					fs::path path = resolve(str->data, moduleFolder);
+					if (!path.empty()) queue(path);
+				} catch (fs::filesystem_error&) {} // reported once included
+			}
+		}
+	}
+	void queue(fs::path path) {
+		lock_guard<mutex> guard(lock);
+		if (stopping || prefetches.count(path)) return;
+		prefetches[path] = Prefetch();
+		queued.push_back(path);
+		if (workers.size() < min<size_t>(queued.size(), prefetchWorkerCount())) {
+			workers.push_back(thread([this]() { work(); }));
+		}
+		changed.notify_all();
+	}
+	static size_t prefetchWorkerCount() {
+		return max(1, min(4, (int)thread::hardware_concurrency() - 1)); // compiling thread takes one core
+	}
+	/// moves prefetched tokens of the module into scope's current module
+	/// - waits if a worker is tokenizing it
+	/// @returns false if the module has to be tokenized now - not prefetched, not started or tokenized with errors
+	bool takePrefetched(fs::path abspath, Scope& scope) {
+		unique_lock<mutex> guard(lock);
+		Prefetch& prefetch = prefetches[abspath];
+		if (prefetch.state == PSqueued || prefetch.state == PStaken) {
+			prefetch.state = PStaken;
+			return false;
+		}
+		changed.wait(guard, [&]() { return prefetch.state == PSdone; });
+		prefetch.state = PStaken;
+		if (!prefetch.errorLess) return false;
+		scope.loadModuleTokens(move(prefetch.tokens));
+		tokenStats.adopt(prefetch.tokensCreated, prefetch.tokensLive);
+		return true;
+	}
+	void work() {
+		unique_lock<mutex> guard(lock);
+		while (true) {
+			changed.wait(guard, [&]() { return stopping || queued.size(); });
+			if (stopping) return;
+			fs::path path = queued.front(); queued.pop_front();
+			Prefetch& prefetch = prefetches[path];
+			if (prefetch.state != PSqueued) continue; // taken by the compiling thread
+			prefetch.state = PSrunning;
+			guard.unlock();
+			Prefetch done;
+			done.state = PSdone;
+			done.errorLess = tokenizeDetached(path, done);
+			if (done.errorLess) prefetchIncludes(done.tokens, path.parent_path());
+			guard.lock();
+			prefetch = move(done);
+			changed.notify_all();
+		}
+	}
+	/// tokenizes the module in its own scratch compilation, errors are dropped
+	bool tokenizeDetached(fs::path abspath, Prefetch& out) {
+		if (useModuleCache) {
+			lock_guard<mutex> guard(moduleCacheMutex);
+			if (moduleCache.count(abspath) && moduleCache[abspath].mtime == fs::last_write_time(abspath)) return false; // loaded from the cache
+		}
+		Compilation scratch(flags);
+		stringstream dropped;
+		scratch.out = &dropped;
+		scratch.err = &dropped;
+		scratch.flags.timeReport = false;
+		comp = &scratch;
+		try {
+			Scope scope;
+			string relPath = relPathFromMasfix(abspath);
+			scope.addNewModule(abspath, relPath, abspath.filename().replace_extension("").string());
+			ifstream ifs = openInputFile(abspath);
+			unsigned long long createdBefore = tokenStats.created;
+			long long liveBefore = tokenStats.live;
+			tokenize(ifs, relPath, scope);
+			out.tokensCreated = tokenStats.created - createdBefore;
+			out.tokensLive = tokenStats.live - liveBefore;
+			out.tokens = move(scope.currModuleTokens());
+		} catch (CompilationFailed&) {
+		} catch (exception&) {
+			scratch.errors.push_back("");
+		}
+		comp = nullptr;
+		return scratch.errors.empty();
+	}
+};
 string tokenizeNewModule(fs::path abspath, Scope& scope, bool mainModule=false) {
 	string relPath = relPathFromMasfix(abspath);
 	string moduleName = mainModule ? TOP_MODULE_NAME : abspath.filename().replace_extension("").string(); // TODO name sanitazion, module name redefs?
 	scope.addNewModule(abspath, relPath, moduleName);
-	ifstream ifs = openInputFile(abspath);
-	tokenize(ifs, relPath, scope);
-	ifs.close();
+	comp->parseCtx.moduleFiles[relPath] = abspath;
+	if (mainModule) comp->parseCtx.mainPath = abspath;
+	fs::file_time_type mtime;
+	if (useModuleCache) {
+		mtime = fs::last_write_time(abspath);
+		bool cached = false;
+		{
+			lock_guard<mutex> lock(moduleCacheMutex);
+			if (moduleCache.count(abspath) && moduleCache[abspath].mtime == mtime) {
+				scope.loadModuleTokens(moduleCache[abspath].tokens);
+				cached = true;
+			}
+		}
+		if (cached) { // includes of cached modules are still prefetched, they may have changed
+			scope.loader->prefetchIncludes(scope.currModuleTokens(), abspath.parent_path());
+			return relPath;
+		}
+	}
+	size_t errorsBefore = comp->errors.size();
+	{
+		PhaseTimer timer("tokenize", relPath);
+		if (!scope.loader->takePrefetched(abspath, scope)) {
+			ifstream ifs = openInputFile(abspath);
+			tokenize(ifs, relPath, scope);
+			scope.loader->prefetchIncludes(scope.currModuleTokens(), abspath.parent_path());
+		}
+	}
+	if (useModuleCache && comp->errors.size() == errorsBefore) { // NOTE modules with errors are always retokenized
+		lock_guard<mutex> lock(moduleCacheMutex);
+		moduleCache[abspath] = CachedModule{mtime, scope.currModuleTokens()};
+	}
 	return relPath;
 }
 
 // preprocess -------------------------------------------------------------------------
 bool lookupNamespaceAbove(string directiveName, int& namespaceId, Loc& loc, bool supressErrors=false);
-bool preprocess(Scope& scope);
 bool eatComplexIdentifier(Scope& scope, Loc loc, string& ident, string purpose, bool canStartLine, bool allowQuotes=false);
 
 bool arglistFromTlist(Scope& scope, Loc& loc, Macro& mac) {
@@ -1113,22 +1695,25 @@ bool eatDefineValue(Scope& scope, Token& outToken, Loc& loc, bool sameLine) {
 	}
 	return true;
 }
-bool processDefineDef(Scope& scope, string name, Loc loc, Loc percentLoc) {
+bool processDefineDef(Scope& scope, string name, Loc loc, Loc percentLoc, Continuation then) {
 	Token numeric;
 	if (scope.hasNext() && scope->type == Tlist && !scope->firstOnLine) {
 		Token& token = scope.currToken(); loc = token.loc;
 		checkReturnOnFail(!token.continued, "Unexpected continued field", token);
-		processArglistWrapper( bool retval = preprocess(scope); );
-		processArglistWrapper(
-			retval = eatDefineValue(scope, numeric, loc, false);
-			retval = retval && check(!scope.hasNext(), "Unexpected token after value", scope.currToken());
-		);
-		scope.eatenToken(); // tlist
-	} else {
-		returnOnFalse(eatDefineValue(scope, numeric, loc, true));
-	}
+		return scope.preprocessArglist(token, [&scope, tlist = &token, name, loc, percentLoc, then]() mutable {
+			Token& token = *tlist; Token numeric;
+			processArglistWrapper(
+				bool retval = eatDefineValue(scope, numeric, loc, false);
+				retval = retval && check(!scope.hasNext(), "Unexpected token after value", scope.currToken());
+			);
+			scope.eatenToken(); // tlist
+			scope.topNamespace().defines[name] = Define(name, percentLoc, numeric.data);
+			return then();
+		});
+	}
+	returnOnFalse(eatDefineValue(scope, numeric, loc, true));
 	scope.topNamespace().defines[name] = Define(name, percentLoc, numeric.data);
-	return true;
+	return then();
 }
 bool processMacroDef(Scope& scope, string name, Loc loc, Loc percentLoc) {
 	Token token;
@@ -1152,68 +1737,77 @@ bool processNamespaceDef(string name, Loc loc, Token& percentToken, Scope& scope
 	return true;
 }
 
-bool eatDefinedDirectiveName(string directive, Scope& scope, string& name, Token& percentToken, Loc& loc) {
+bool eatDefinedDirectiveName(string directive, Scope& scope, Loc loc, function<bool(string, Loc)> then) {
+	string name;
 	if (scope.hasNext() && scope->type == Tlist && !scope->firstOnLine) {
 		Token& token = scope.currToken(); loc = token.loc;
-		processArglistWrapper( bool retval = preprocess(scope); );
-		processArglistWrapper(
-			retval = eatComplexIdentifier(scope, loc, name, directive, true);
-			retval = retval && check(!scope.hasNext(), "Unexpected token after define name", scope.currToken());
-		);
-		scope.eatenToken();
-	} else {
-		directiveEatIdentifier(directive, true, 1);
+		return scope.preprocessArglist(token, [&scope, tlist = &token, directive, loc, then]() {
+			Token& token = *tlist; string name;
+			processArglistWrapper(
+				bool retval = eatComplexIdentifier(scope, loc, name, directive, true);
+				retval = retval && check(!scope.hasNext(), "Unexpected token after define name", scope.currToken());
+			);
+			scope.eatenToken();
+			return then(name, loc);
+		});
 	}
-	return true;
+	directiveEatIdentifier(directive, true, 1);
+	return then(name, loc);
+}
+bool checkDirectiveEnd(Scope& scope) {
+	return check(!scope.hasNext() || scope->firstOnLine, "Unexpected token after directive", scope.currToken());
 }
 bool processDirectiveDef(string directive, Scope& scope, Token& percentToken, Loc loc) {
 	static_assert(DefiningDirectivesCount == 3, "Exhaustive processDirectiveDef definition");
-	string name;
-	returnOnFalse(eatDefinedDirectiveName(directive, scope, name, percentToken, loc));
-	if (directive == "define") {
-		returnOnFalse(processDefineDef(scope, name, loc, percentToken.loc));
-	} else if (directive == "macro") {
-		returnOnFalse(processMacroDef(scope, name, loc, percentToken.loc));
-	} else if (directive == "namespace") {
-		returnOnFalse(processNamespaceDef(name, loc, percentToken, scope));
-	} else {
-		unreachable();
-	}
-	return check(!scope.hasNext() || scope->firstOnLine, "Unexpected token after directive", scope.currToken());
+	return eatDefinedDirectiveName(directive, scope, loc, [&scope, directive, percentToken](string name, Loc loc) mutable {
+		if (directive == "define") {
+			return processDefineDef(scope, name, loc, percentToken.loc, [&scope]() { return checkDirectiveEnd(scope); });
+		} else if (directive == "macro") {
+			returnOnFalse(processMacroDef(scope, name, loc, percentToken.loc));
+		} else if (directive == "namespace") {
+			returnOnFalse(processNamespaceDef(name, loc, percentToken, scope));
+		} else {
+			unreachable();
+		}
+		return checkDirectiveEnd(scope);
+	});
 }
 void expandDefineUse(Token& percentToken, Scope& scope, int namespaceId, string defineName) {
-	Define& define = IdToNamespace[namespaceId].defines[defineName];
+	Define& define = comp->namespaces[namespaceId].defines[defineName];
 	scope.insertToken(Token::fromCtx(Tnumeric, define.value, percentToken));
 }
-bool processExpansionArglist(Token& token, Scope& scope, Macro& mac, Loc& loc) {
-	assert(token.type == Tlist);
-	if (token.tlist.size()) {
-		processArglistWrapper(
-			bool retval = preprocess(scope);
-			retval = retval && scope.sliceArglist(mac, loc);
-		);
-	} else {
-		if (mac.argList.size() == 1) { // register empty argument
-			vector<pair<list<Token>::iterator, list<Token>::iterator>> argSpans;
-			argSpans.push_back(pair(token.tlist.begin(), token.tlist.end()));
-			mac.addExpansionArgs(argSpans);
-		}
-		return check(mac.argList.size() <= 1, "Missing expansion arguments", loc, mac.noteArglist());
+bool processExpansionArglist(Token& eaten, Scope& scope, Macro& mac, Loc loc, Continuation then) {
+	assert(eaten.type == Tlist);
+	if (eaten.tlist.size()) {
+		shared_ptr<Token> arglist = make_shared<Token>(move(eaten)); // already eaten, has to outlive the suspension
+		return scope.preprocessArglist(*arglist, [&scope, arglist, &mac, loc, then]() {
+			Token& token = *arglist;
+			processArglistWrapper( bool retval = scope.sliceArglist(mac, loc); );
+			return then();
+		});
+	}
+	if (mac.argList.size() == 1) { // register empty argument
+		vector<pair<list<Token>::iterator, list<Token>::iterator>> argSpans;
+		argSpans.push_back(pair(eaten.tlist.begin(), eaten.tlist.end()));
+		mac.addExpansionArgs(argSpans);
 	}
-	return true;
+	checkReturnOnFail(mac.argList.size() <= 1, "Missing expansion arguments", loc, mac.noteArglist());
+	return then();
 }
 bool expandMacroUse(Scope& scope, int namespaceId, string macroName, Token& percentToken) {
 	bool ctime = percentToken.data == "!";
-	Macro& mac = IdToNamespace[namespaceId].macros[macroName]; Token token; Loc loc = percentToken.loc;
+	Macro& mac = comp->namespaces[namespaceId].macros[macroName]; Token token; Loc loc = percentToken.loc;
 	directiveEatToken(Tlist, "Expansion arglist expected", true);
-	returnOnFalse(processExpansionArglist(token, scope, mac, loc));
-	checkReturnOnFail(!scope.hasNext() || scope->firstOnLine || scope->type == Tseparator ||
-		(!scope->continued && !scope.insideTlistOfType(TIarglist)), "Unexpected token after macro use", scope.currToken());
+	return processExpansionArglist(token, scope, mac, loc, [&scope, namespaceId, macroName, percentToken, &mac, ctime]() {
+		checkReturnOnFail(!scope.hasNext() || scope->firstOnLine || scope->type == Tseparator ||
+			(!scope->continued && !scope.insideTlistOfType(TIarglist)), "Unexpected token after macro use", scope.currToken());
 
-	Token expanded = Token::fromCtx(ctime ? TIctime : TIexpansion, macroName, percentToken);
-	expanded.tlist = list(mac.body.begin(), mac.body.end());
-	scope.addMacroExpansion(namespaceId, expanded);
-	return true;
+		Token expanded = Token::fromCtx(ctime ? TIctime : TIexpansion, macroName, percentToken);
+		expanded.tlist = list(mac.body.begin(), mac.body.end());
+		if (comp->flags.tracksExpansions()) comp->parseCtx.addExpansion(expanded, mac.loc);
+		scope.addMacroExpansion(namespaceId, expanded);
+		return true;
+	});
 }
 bool getDirectivePrefixes(string& firstName, list<string>& prefixes, list<Loc>& locs, Loc& loc, Scope& scope, string identPurpose="directive") {
 	static_assert(TokenCount == 13, "Exhaustive getDirectivePrefixes definition");
@@ -1229,25 +1823,28 @@ bool getDirectivePrefixes(string& firstName, list<string>& prefixes, list<Loc>&
 	}
 	return true;
 }
-bool complexDirectiveName(Scope& scope, string& firstName, list<string>& prefixes, list<Loc>& locs, Loc& loc) {
+bool complexDirectiveName(Scope& scope, Loc loc, function<bool(string&, list<string>&, list<Loc>&, Loc)> then) {
+	string firstName; list<string> prefixes; list<Loc> locs;
 	if (scope.hasNext() && scope->type == Tlist && !scope->firstOnLine) {
 		Token& token = scope.currToken(); loc = token.loc;
-		processArglistWrapper( bool retval = preprocess(scope); );
-		processArglistWrapper(
-			retval = eatComplexIdentifier(scope, loc, firstName, "directive", false);
-			retval = retval && check(!scope.hasNext(), "Unexpected token after directive name", scope.currToken());
-		)
-		locs.push_back(loc);
-		scope.eatenToken();
-	} else {
-		return getDirectivePrefixes(firstName, prefixes, locs, loc, scope, "directive");
+		return scope.preprocessArglist(token, [&scope, tlist = &token, loc, then]() {
+			Token& token = *tlist; string firstName; list<string> prefixes; list<Loc> locs;
+			processArglistWrapper(
+				bool retval = eatComplexIdentifier(scope, loc, firstName, "directive", false);
+				retval = retval && check(!scope.hasNext(), "Unexpected token after directive name", scope.currToken());
+			)
+			locs.push_back(loc);
+			scope.eatenToken();
+			return then(firstName, prefixes, locs, loc);
+		});
 	}
-	return true;
+	returnOnFalse(getDirectivePrefixes(firstName, prefixes, locs, loc, scope, "directive"));
+	return then(firstName, prefixes, locs, loc);
 }
 bool defineDefined(string& name, int& namespaceId, bool firstPrefix=false) {
-	if (IdToNamespace[namespaceId].defines.count(name)) return true;
-	if (firstPrefix) for (int id : IdToNamespace[namespaceId].usedNamespaces) {
-		if (IdToNamespace[id].defines.count(name)) {
+	if (comp->namespaces[namespaceId].defines.count(name)) return true;
+	if (firstPrefix) for (int id : comp->namespaces[namespaceId].usedNamespaces) {
+		if (comp->namespaces[id].defines.count(name)) {
 			namespaceId = id;
 			return true;
 		}
@@ -1255,9 +1852,9 @@ bool defineDefined(string& name, int& namespaceId, bool firstPrefix=false) {
 	return false;
 }
 bool macroDefined(string& name, int& namespaceId, bool firstPrefix=false) {
-	if (IdToNamespace[namespaceId].macros.count(name)) return true;
-	if (firstPrefix) for (int id : IdToNamespace[namespaceId].usedNamespaces) {
-		if (IdToNamespace[id].macros.count(name)) {
+	if (comp->namespaces[namespaceId].macros.count(name)) return true;
+	if (firstPrefix) for (int id : comp->namespaces[namespaceId].usedNamespaces) {
+		if (comp->namespaces[id].macros.count(name)) {
 			namespaceId = id;
 			return true;
 		}
@@ -1265,13 +1862,13 @@ bool macroDefined(string& name, int& namespaceId, bool firstPrefix=false) {
 	return false;
 }
 bool namespaceDefined(string& name, int& namespaceId, bool firstPrefix=false) {
-	if (IdToNamespace[namespaceId].innerNamespaces.count(name)) {
-		namespaceId = IdToNamespace[namespaceId].innerNamespaces[name];
+	if (comp->namespaces[namespaceId].innerNamespaces.count(name)) {
+		namespaceId = comp->namespaces[namespaceId].innerNamespaces[name];
 		return true;
 	}
-	if (firstPrefix) for (int id : IdToNamespace[namespaceId].usedNamespaces) {
-		if (IdToNamespace[id].innerNamespaces.count(name)) {
-			namespaceId = IdToNamespace[id].innerNamespaces[name];
+	if (firstPrefix) for (int id : comp->namespaces[namespaceId].usedNamespaces) {
+		if (comp->namespaces[id].innerNamespaces.count(name)) {
+			namespaceId = comp->namespaces[id].innerNamespaces[name];
 			return true;
 		}
 	}
@@ -1280,7 +1877,7 @@ bool namespaceDefined(string& name, int& namespaceId, bool firstPrefix=false) {
 void lookupFinalAbove(string directiveName, int& namespaceId, bool& namespaceSeen) {
 	Namespace* currNamespace;
 	while (true) {
-		currNamespace = &IdToNamespace[namespaceId];
+		currNamespace = &comp->namespaces[namespaceId];
 		if (defineDefined(directiveName, namespaceId, true) || macroDefined(directiveName, namespaceId, true)) return;
 		namespaceSeen = namespaceSeen || currNamespace->innerNamespaces.count(directiveName);
 		if (!currNamespace->isUpperAccesible) return;
@@ -1290,7 +1887,7 @@ void lookupFinalAbove(string directiveName, int& namespaceId, bool& namespaceSee
 bool lookupNamespaceAbove(string directiveName, int& namespaceId, Loc& loc, bool supressErrors) {
 	Namespace* currNamespace;
 	while (true) {
-		currNamespace = &IdToNamespace[namespaceId];
+		currNamespace = &comp->namespaces[namespaceId];
 		if (namespaceDefined(directiveName, namespaceId, true)) return true;
 		if (!currNamespace->isUpperAccesible) break;
 		namespaceId = currNamespace->upperNamespaceId;
@@ -1341,20 +1938,92 @@ bool processUsing(Loc loc, Scope& scope) {
 	return true;
 }
 fs::path processIncludePath(string str, Scope& scope) {
-	fs::path path = fs::path(str);
-	if (path.has_extension() && path.extension() != ".mx") return fs::path();
-	fs::path moduleRel = scope.currModuleFolder() / path.replace_extension(".mx");
-	if (fs::exists(moduleRel)) return fs::canonical(moduleRel);
-
-	for (fs::path prepath : flags.includeFolders) {
-		path = prepath;
-		path /= fs::path(str).replace_extension(".mx");
-		if (fs::exists(path)) break;
+	return scope.loader->resolve(str, scope.currModuleFolder());
+}
+bool eatDataValues(Scope& scope, vector<unsigned>& values) {
+	while (scope.hasNext()) {
+		Token value = scope.eatenToken();
+		if (value.type == Tseparator) continue;
+		if (value.type == Tstring) {
+			for (size_t i = 0; i < value.data.size(); ++i) {
+				char c = value.data[i];
+				if (c == '\\') c = escapeSequences.at(value.data.at(++i));
+				values.push_back((unsigned char)c);
+			}
+		} else if (value.type == Tchar) {
+			values.push_back((unsigned char)escapeCharToken(value));
+		} else {
+			checkReturnOnFail(value.type == Tnumeric && value.data.size() <= 10 && isdigit(value.data.at(0)) &&
+				to_string(stoll(value.data)) == value.data && stoll(value.data) <= comp->wordMaxVal(), "Invalid data value", value);
+			values.push_back(stoll(value.data));
+		}
+	}
+	return true;
+}
+/// places words, chars and strings (word per char) into the initial memory of the program and of the ctime VM
+/// - %static <address> (<values>) - at the address, numeric or expr wrapped in braces
+/// - %static <name> <address>? (<values>) - name is defined as their address,
+/// 	without address they follow the last named data, the first ones start at SEG_DATA of std memory layout
+/// places the preprocessed values list at addr, defines name as addr unless empty
+bool processDataValues(Scope& scope, string name, long long addr, Loc loc, Continuation then) {
+	checkReturnOnFail(addr != -1, "Missing data address, no named static data to follow", loc);
+	checkReturnOnFail(scope.hasNext() && scope->type == Tlist && !scope->firstOnLine, "Data values list expected", loc);
+	Token& token = scope.currToken(); loc = token.loc;
+	return scope.preprocessArglist(token, [&scope, tlist = &token, name, addr, loc, then]() mutable {
+		Token& token = *tlist; vector<unsigned> values;
+		processArglistWrapper( bool retval = eatDataValues(scope, values); );
+		scope.eatenToken(); // tlist
+		checkReturnOnFail(addr + values.size() <= comp->wordMaxVal() + 1, "Data exceed the memory, " + to_string(values.size()) + " words at " + to_string(addr), loc);
+		comp->withVM([&](auto& vm) {
+			for (size_t i = 0; i < values.size(); ++i) {
+				comp->parseCtx.data[addr + i] = values[i];
+				vm.mem[addr + i] = values[i];
+			}
+		});
+		if (!name.empty()) {
+			comp->parseCtx.dataCursor = addr + values.size();
+			scope.topNamespace().defines[name] = Define(name, loc, to_string(addr));
+		}
+		return then();
+	});
+}
+optional<size_t> namespaceDefine(string namespaceName, string defineName);
+bool processData(Scope& scope, Loc loc, Continuation then) {
+	string name;
+	long long addr = -1;
+	checkReturnOnFail(scope.hasNext() && !scope->firstOnLine, "Data address or name expected", loc);
+	if (scope->type == Talpha) {
+		directiveEatIdentifier("static", true, 0);
+		addr = comp->parseCtx.dataCursor;
+		if (addr == -1) addr = namespaceDefine("MEMORY_LAYOUT", "SEG_DATA").value_or(-1); // first named data of std programs
+	}
+	bool hasAddress = scope.hasNext() && !scope->firstOnLine;
+	if (hasAddress && !name.empty() && scope->type == Tlist) { // address list is followed by the values list
+		Token* following = scope.peekNext();
+		hasAddress = following && following->type == Tlist && !following->firstOnLine;
+	}
+	if (hasAddress && scope->type == Tlist) {
+		Token& token = scope.currToken(); loc = token.loc;
+		return scope.preprocessArglist(token, [&scope, tlist = &token, name, loc, then]() mutable {
+			Token& token = *tlist; Token numeric;
+			processArglistWrapper(
+				bool retval = eatDefineValue(scope, numeric, loc, false);
+				retval = retval && check(!scope.hasNext(), "Unexpected token after address", scope.currToken());
+			);
+			scope.eatenToken(); // tlist
+			checkReturnOnFail(numeric.data.size() <= 10, "Data address out of the memory", loc);
+			return processDataValues(scope, name, stoll(numeric.data), loc, then);
+		});
+	} else if (hasAddress) {
+		Token numeric;
+		returnOnFalse(eatDefineValue(scope, numeric, loc, true));
+		checkReturnOnFail(numeric.data.size() <= 10, "Data address out of the memory", loc);
+		addr = stoll(numeric.data);
 	}
-	return fs::exists(path) ? fs::canonical(path) : fs::path();
+	return processDataValues(scope, name, addr, loc, then);
 }
 bool processBuiltinUse(string directive, Scope& scope, Loc loc) {
-	static_assert(BuiltinDirectivesCount == 2, "Exhaustive processBuiltinUse definition");
+	static_assert(BuiltinDirectivesCount == 3, "Exhaustive processBuiltinUse definition");
 	Token token;
 	if (directive == "using") {
 		returnOnFalse(processUsing(loc, scope));
@@ -1363,10 +2032,12 @@ bool processBuiltinUse(string directive, Scope& scope, Loc loc) {
 		fs::path path = processIncludePath(token.data, scope);
 		checkReturnOnFail(fs::exists(path), "Input file \"" + token.data + "\" can't be included", loc);
 		if (scope.newModuleIncluded(path)) tokenizeNewModule(path, scope);
+	} else if (directive == "static") {
+		return processData(scope, loc, [&scope]() { return checkDirectiveEnd(scope); });
 	} else {
 		unreachable();
 	}
-	return check(!scope.hasNext() || scope->firstOnLine, "Unexpected token after directive", scope.currToken());
+	return checkDirectiveEnd(scope);
 }
 bool checkDirectiveContext(Scope& scope, string dirType, string directiveName, list<string> prefixes, list<Loc> locs, Token& percentToken) {
 	checkReturnOnFail(!prefixes.size(), dirType + " has unexpected accessor" + errorQuoted(prefixes.front()), *(++locs.begin()));
@@ -1374,7 +2045,7 @@ bool checkDirectiveContext(Scope& scope, string dirType, string directiveName, l
 	checkReturnOnFail(!scope.hasNext() || !scope->continued, "Unexpected continued token", scope.currToken());
 	if (dirType != "macro arg") {
 		checkReturnOnFail(!scope.insideTlistOfType(TIarglist), dirType + " not allowed inside arglist", percentToken.loc);
-		if (directiveName != "define" && directiveName != "macro") {
+		if (directiveName != "define" && directiveName != "macro" && directiveName != "static") {
 			checkReturnOnFail(!scope.insideMacro(), dirType + " not allowed inside macro", percentToken.loc);
 		}
 		checkReturnOnFail(percentToken.firstOnLine, "Unexpected directive here" + errorQuoted(directiveName), percentToken.loc);
@@ -1383,22 +2054,21 @@ bool checkDirectiveContext(Scope& scope, string dirType, string directiveName, l
 }
 bool processDirective(Token percentToken, Scope& scope) {
 	static_assert(TokenCount == 13, "Exhaustive processDirective definition");
-	string directiveName; list<string> prefixes; list<Loc> locs; Loc loc = percentToken.loc;
-	returnOnFalse(complexDirectiveName(scope, directiveName, prefixes, locs, loc));
-	if (DefiningDirectivesSet.count(directiveName)) {
-		returnOnFalse(checkDirectiveContext(scope, "Definition", directiveName, prefixes, locs, percentToken));
-		returnOnFalse(processDirectiveDef(directiveName, scope, percentToken, loc));
-	} else if (BuiltinDirectivesSet.count(directiveName)) {
-		returnOnFalse(checkDirectiveContext(scope, "Directive", directiveName, prefixes, locs, percentToken));
-		returnOnFalse(processBuiltinUse(directiveName, scope, loc));
-	} else if (!prefixes.size() && scope.hasMacroArg(directiveName)) {
-		returnOnFalse(checkDirectiveContext(scope, "macro arg", directiveName, prefixes, locs, percentToken));
-		list<Token>& argField = scope.currMacro().nameToArg(directiveName).value.top();
-		scope.insertList(argField, percentToken, true);
-	} else {
+	return complexDirectiveName(scope, percentToken.loc, [&scope, percentToken](string& directiveName, list<string>& prefixes, list<Loc>& locs, Loc loc) mutable {
+		if (DefiningDirectivesSet.count(directiveName)) {
+			returnOnFalse(checkDirectiveContext(scope, "Definition", directiveName, prefixes, locs, percentToken));
+			return processDirectiveDef(directiveName, scope, percentToken, loc);
+		} else if (BuiltinDirectivesSet.count(directiveName)) {
+			returnOnFalse(checkDirectiveContext(scope, "Directive", directiveName, prefixes, locs, percentToken));
+			return processBuiltinUse(directiveName, scope, loc);
+		} else if (!prefixes.size() && scope.hasMacroArg(directiveName)) {
+			returnOnFalse(checkDirectiveContext(scope, "macro arg", directiveName, prefixes, locs, percentToken));
+			list<Token>& argField = scope.currMacro().nameToArg(directiveName).value.top();
+			scope.insertList(argField, percentToken, true);
+			return true;
+		}
 		return lookupName(percentToken, directiveName, prefixes, locs, scope);
-	}
-	return true;
+	});
 }
 
 #define _eatLineOnFalseCONTINUE_OP(cond, continueOP, ...) if (!(cond)) { \
@@ -1410,9 +2080,19 @@ bool processDirective(Token percentToken, Scope& scope) {
 
 /// preprocesses given scope, parses completed modules
 /// closes all scopes
+/// - directives with arglists are suspended on Scope's work stack and resumed here, nesting doesn't recurse
 bool preprocess(Scope& scope) {
-	bool errorLess = true;
-	while (scope.advanceIteration()) {
+	bool moduleErrorLess = true;
+	auto levelErrorLess = [&]() -> bool& { return scope.hasSuspended() ? scope.suspendedErrorLess() : moduleErrorLess; };
+	while (true) {
+		if (!scope.advanceIteration()) {
+			if (!scope.hasSuspended()) break;
+			Continuation then = scope.resumeSuspended();
+			bool& errorLess = levelErrorLess();
+			eatLineOnFalse(then && then());
+			continue;
+		}
+		bool& errorLess = levelErrorLess();
 		Token& currToken = scope.currToken();
 		if (currToken.type == Tspecial && (currToken.data == "%" || currToken.data == "!")) {
 			eatLineOnFalse(check(!currToken.continued, "Directive must not continue", currToken.loc));
@@ -1421,7 +2101,7 @@ bool preprocess(Scope& scope) {
 		}
 		scope.next(currToken);
 	}
-	return errorLess;
+	return moduleErrorLess;
 }
 // token stream parsing -----------------------------------
 bool eatComplexIdentifier(Scope& scope, Loc loc, string& ident, string purpose, bool canStartLine, bool allowQuotes) {
@@ -1467,7 +2147,7 @@ bool dumpImpl(optional<ofstream>& dumpFile, int indent, string s) {
 	dumpFile.value() << string(indent, '\t') << s << '\n';
 	return true;
 }
-#define dump(str) (!!parseCtx.dumpFile) && dumpImpl(parseCtx.dumpFile, scope.expansionDepth(), str)
+#define dump(str) (!!comp->parseCtx.dumpFile) && dumpImpl(comp->parseCtx.dumpFile, scope.expansionDepth(), str)
 #define dumpExpansion(str) dump("; " + str)
 /// chops given token stream into individual asm instructions
 /// registers asm labels, creates unprocessed assembly instruction fields
@@ -1477,9 +2157,9 @@ void parseTokenStream(Scope& scope) {
 	bool labelOnLine;
 	bool errorLess; // ignored
 	while (scope.advanceIteration()) {
-		if (scope.getCurrModule() != parseCtx.lastModule) {
-			parseCtx.lastModule = scope.getCurrModule();
-			dumpExpansion(parseCtx.lastModule->abspath.string() + " ----");
+		if (scope.getCurrModule() != comp->parseCtx.lastModule) {
+			comp->parseCtx.lastModule = scope.getCurrModule();
+			dumpExpansion(comp->parseCtx.lastModule->abspath.string() + " ----");
 		}
 		Token& top = scope.currToken(); loc = top.loc; string name;
 		labelOnLine = labelOnLine && !top.firstOnLine;
@@ -1488,13 +2168,14 @@ void parseTokenStream(Scope& scope) {
 			eatLineOnFalse(eatComplexIdentifier(scope, loc, name, "label", false, true));
 			checkContinueOnFail(!labelOnLine, "Max one label per line", loc);
 			labelOnLine = true;
-			parseCtx.strToLabel.insert(pair(name, Label(name, parseCtx.instrs.size(), loc)));
+			comp->parseCtx.strToLabel.insert(pair(name, Label(name, comp->parseCtx.instrs.size(), loc)));
 			dump(':' + name);
 		} else if (top.type == Talpha) {
 			Instr instr(loc);
+			instr.expansionId = top.expansionId;
 			eatLineOnFalse(parseInstrTS(scope, loc, instr));
 			dump(instr.toStr());
-			parseCtx.instrs.push_back(instr);
+			comp->parseCtx.instrs.push_back(instr);
 		} else if (top.type == TIexpansion || top.type == TInamespace) {
 			dumpExpansion(top.loc.toStr() + ' ' + top.data);
 			scope.next(top);
@@ -1524,7 +2205,7 @@ bool parseCond(Instr& instr, string& s) {
 	checkReturnOnFail(field == empty, error, instr); \
 	field = value;
 bool parseSuffixes(Instr& instr, string s, bool condExpected=false) {
-	static_assert(RegisterCount == 5 && OperationCount == 10 && sizeof(Suffix) == 4 * 5, "Exhaustive parseSuffixes definition");
+	static_assert(RegisterCount == 5 && OperationCount == 12 && sizeof(Suffix) == 4 * 5, "Exhaustive parseSuffixes definition");
 	if (condExpected) {
 		instr.suffixes.condReg = Rr; // default
 		returnOnFalse(parseCond(instr, s));
@@ -1554,7 +2235,7 @@ bool parseSuffixes(Instr& instr, string s, bool condExpected=false) {
 	return true;
 }
 bool parseInstrOpcode(Instr& instr) {
-	static_assert(InstructionCount == 14, "Exhaustive parseInstrOpcode definition");
+	static_assert(InstructionCount == 18, "Exhaustive parseInstrOpcode definition");
 	for (int checkedLen = min(4, (int)instr.opcodeStr.size()); checkedLen > 0; checkedLen --) { // avoid parsing 'ld' as Il, 'str' as Is, 'swap' as Is and so on
 		string substr = instr.opcodeStr.substr(0, checkedLen);
 		if (StrToInstr.count(substr) == 1) {
@@ -1568,15 +2249,15 @@ bool parseInstrOpcode(Instr& instr) {
 bool verifyNotInstrOpcode(string name) {
 	Instr instr;
 	instr.opcodeStr = name;
-	SupressErrors = true;
+	comp->supressErrors = true;
 	bool ans = !parseInstrOpcode(instr);
-	SupressErrors = false;
+	comp->supressErrors = false;
 	return ans;
 }
 bool parseNumericalImmediate(Token& imm, Instr& instr) {
 	if (imm.type == Tnumeric) {
-		checkReturnOnFail(isdigit(imm.data.at(0)), "Invalid instruction immediate", instr);
-		instr.immediate = stoi(imm.data);
+		checkReturnOnFail(isdigit(imm.data.at(0)) && imm.data.size() <= 10, "Invalid instruction immediate", instr);
+		instr.immediate = stoll(imm.data);
 		checkReturnOnFail(to_string(instr.immediate) == imm.data, "Invalid instruction immediate", instr);
 	} else if (imm.type == Tchar) {
 		instr.immediate = escapeCharToken(imm);
@@ -1589,18 +2270,18 @@ bool parseInstrImmediate(Instr& instr) {
 	checkReturnOnFail(instr.immediates.size() == 1, "Only single immediate allowed", instr);
 	Token& imm = instr.immediates.front();
 	if (imm.type == Talpha) {
-		if (!parseCtx.strToLabel.count(imm.data)) {
+		if (!comp->parseCtx.strToLabel.count(imm.data)) {
 			checkReturnOnFail(_validIdentChar(imm.data.at(0)), "Invalid instruction immediate", instr);
 			return check(false, "Undefined label", instr);
 		}
-		instr.immediate = parseCtx.strToLabel[imm.data].addr;
+		instr.immediate = comp->parseCtx.strToLabel[imm.data].addr;
 		if (imm.data == "end") instr.needsReparsing = true;
 	} else if (imm.type == Tnumeric || imm.type == Tchar) {
 		returnOnFalse(parseNumericalImmediate(imm, instr));
 	} else {
 		checkReturnOnFail(false, "Invalid instruction immediate", instr);
 	}
-	return check(0 <= instr.immediate && instr.immediate <= WORD_MAX_VAL, "Value of the immediate is out of bounds", instr);
+	return check(0 <= instr.immediate && instr.immediate <= comp->wordMaxVal(), "Value of the immediate is out of bounds", instr);
 }
 bool parseInstrFields(Instr& instr) {
 	returnOnFalse(parseInstrOpcode(instr));
@@ -1620,6 +2301,9 @@ bool checkSuffixCombination(Instr& instr) {
 		} else checkReturnOnFail(instr.suffixes.reg == Rr || instr.suffixes.reg == Rm, "Input destination can be only r/m", instr);
 	} else {
 		checkReturnOnFail(instr.hasReg() || instr.hasImm(), "Target value expected", instr);
+		if (instr.instr == Ispsh || instr.instr == Ispop) { // head is placed by the instr itself
+			checkReturnOnFail(!instr.hasMod(), "Stack instructions cannot have a modifier", instr);
+		}
 		if (instr.hasOp()) {
 			checkReturnOnFail(instr.hasReg() && instr.hasImm(), "Missing immediate", instr)
 		} else {
@@ -1630,7 +2314,7 @@ bool checkSuffixCombination(Instr& instr) {
 }
 // checks if the instr has correct combination of suffixes and immediates
 bool checkValidity(Instr& instr) {
-	static_assert(InstructionCount == 14 && sizeof(Suffix) == 4 * 5, "Exhaustive checkValidity definition");
+	static_assert(InstructionCount == 18 && sizeof(Suffix) == 4 * 5, "Exhaustive checkValidity definition");
 	assert(instr.instr != InstructionCount);
 	returnOnFalse(checkSuffixCombination(instr));
 	if (instr.toStr() == "ldr" || instr.toStr() == "strm" || instr.toStr() == "movh") {
@@ -1654,21 +2338,22 @@ bool parseInstrs(ParseCtx& parseCtx) {
 		continueOnFalse(checkValidity(instr));
 		if (instr.needsReparsing) parseCtx.instrsToReparse.push_back(i);
 	}
-	check(instrs.size() <= WORD_MAX_VAL+1, "The instruction count " + to_string(instrs.size()) + " exceeds WORD_MAX_VAL=" + to_string(WORD_MAX_VAL), instrs[instrs.size()-1].opcodeLoc);
+	check(instrs.size() <= comp->wordMaxVal()+1, "The instruction count " + to_string(instrs.size()) + " exceeds the word max value " + to_string(comp->wordMaxVal()), instrs[instrs.size()-1].opcodeLoc);
 	return errorLess;
 }
 bool Scope::forceParseImpl() {
-	parseCtx.parseStartIdx = parseCtx.instrs.size();
+	comp->parseCtx.parseStartIdx = comp->parseCtx.instrs.size();
 	parseTokenStream(*this);
-	parseCtx.strToLabel["end"].addr = parseCtx.instrs.size();
-	for (int idx : parseCtx.instrsToReparse) {
-		Instr& instr = parseCtx.instrs[idx];
+	comp->parseCtx.strToLabel["end"].addr = comp->parseCtx.instrs.size();
+	for (int idx : comp->parseCtx.instrsToReparse) {
+		Instr& instr = comp->parseCtx.instrs[idx];
 		parseInstrFields(instr);
 	}
-	return parseInstrs(parseCtx);
+	return parseInstrs(comp->parseCtx);
 }
 // interpreting -------------------------------------------------
-unsigned short interpGetReg(VM& vm, RegNames reg) {
+template<typename Word>
+Word interpGetReg(BasicVM<Word>& vm, RegNames reg) {
 	static_assert(RegisterCount == 5, "Exhaustive interpGetReg definition");
 	if (reg == Rh) return vm.head;
 	else if (reg == Rm) return vm.cell();
@@ -1676,23 +2361,27 @@ unsigned short interpGetReg(VM& vm, RegNames reg) {
 	else if (reg == Rp) return vm.ip;
 	else unreachable();
 }
-unsigned short interpOperation(VM& vm, OpNames op, unsigned short left, unsigned short right) {
-	static_assert(OperationCount == 10, "Exhaustive interpOperation definition");
+template<typename Word>
+Word interpOperation(BasicVM<Word>& vm, OpNames op, Word left, Word right) {
+	static_assert(OperationCount == 12, "Exhaustive interpOperation definition");
 	if (op == OPa) return left + right;
 	else if (op == OPs) return left - right;
-	else if (op == OPt) return left * right;
+	else if (op == OPt) return (unsigned long long)left * right;
+	else if (op == OPd) return right ? left / right : numeric_limits<Word>::max();
+	else if (op == OPo) return right ? left % right : left;
 	else if (op == OPand) return left & right;
 	else if (op == OPor) return left | right;
 	else if (op == OPxor) return left ^ right;
-	else if (op == OPshl) return left << right;
-	else if (op == OPshr) return left >> right;
-	else if (op == OPbit) return !!(left & (1 << right));
+	else if (op == OPshl) return (unsigned long long)left << (right & 31); // shift count masked like x86
+	else if (op == OPshr) return left >> (right & 31);
+	else if (op == OPbit) return (left >> (right & 31)) & 1;
 	else unreachable();
 }
-bool interpCond(VM& vm, Instr& instr, signed short target) {
+template<typename Word>
+bool interpCond(BasicVM<Word>& vm, Instr const& instr, make_signed_t<Word> target) {
 	static_assert(ConditionCount == 11, "Exhaustive interpCond definition");
-	signed short ireg = interpGetReg(vm, instr.suffixes.condReg);
-	unsigned short ureg = interpGetReg(vm, instr.suffixes.condReg);
+	make_signed_t<Word> ireg = interpGetReg(vm, instr.suffixes.condReg);
+	Word ureg = interpGetReg(vm, instr.suffixes.condReg);
 	if (instr.instr == Ib) target = 0;
 
 	if (instr.suffixes.cond == Ceq) return ireg == target;
@@ -1701,15 +2390,16 @@ bool interpCond(VM& vm, Instr& instr, signed short target) {
 	if (instr.suffixes.cond == Cle) return ireg <= target;
 	if (instr.suffixes.cond == Cgt) return ireg >  target;
 	if (instr.suffixes.cond == Cge) return ireg >= target;
-	if (instr.suffixes.cond == Cab) return ureg >  (unsigned short)target;
-	if (instr.suffixes.cond == Cae) return ureg >= (unsigned short)target;
-	if (instr.suffixes.cond == Cbl) return ureg <  (unsigned short)target;
-	if (instr.suffixes.cond == Cbe) return ureg <= (unsigned short)target;
+	if (instr.suffixes.cond == Cab) return ureg >  (Word)target;
+	if (instr.suffixes.cond == Cae) return ureg >= (Word)target;
+	if (instr.suffixes.cond == Cbl) return ureg <  (Word)target;
+	if (instr.suffixes.cond == Cbe) return ureg <= (Word)target;
 	unreachable();
 }
-void interpInstrBody(VM& vm, Instr& instr, unsigned short target, bool cond, bool& ipChanged) {
-	static_assert(InstructionCount == 14, "Exhaustive interpInstrBody definition");
-	unsigned short& inputReg = instr.suffixes.reg == Rm ? vm.cell() : vm.reg;
+template<typename Word>
+void interpInstrBody(BasicVM<Word>& vm, Instr const& instr, Word target, bool cond, bool& ipChanged) {
+	static_assert(InstructionCount == 18, "Exhaustive interpInstrBody definition");
+	Word& inputReg = instr.suffixes.reg == Rm ? vm.cell() : vm.reg;
 	if (instr.instr == Imov) vm.head = target;
 	else if (instr.instr == Istr) {
 		vm.cell() = target;
@@ -1728,31 +2418,58 @@ void interpInstrBody(VM& vm, Instr& instr, unsigned short target, bool cond, boo
 	} else if (instr.instr == Is) {
 		vm.cell() = cond ? 1 : 0;
 	} else if (instr.instr == Iswap) {
-		unsigned short temp = vm.cell();
+		Word temp = vm.cell();
 		vm.cell() = vm.reg;
 		vm.reg = temp;
+	} else if (instr.instr == Ifill) {
+		size_t first = min<size_t>(target, vm.CELL_COUNT - vm.head);
+		fill(vm.mem + vm.head, vm.mem + vm.head + first, vm.reg);
+		fill(vm.mem, vm.mem + target - first, vm.reg); // wrapped around
+	} else if (instr.instr == Icopy) {
+		if ((size_t)vm.head + target <= vm.CELL_COUNT && (size_t)vm.reg + target <= vm.CELL_COUNT) {
+			memmove(vm.mem + vm.head, vm.mem + vm.reg, sizeof(Word) * target);
+		} else { // wraps around, copies in the direction not overwriting unread words
+			Word distance = vm.head - vm.reg;
+			if (distance >= target) {
+				for (Word i = 0; i < target; ++i) vm.mem[(Word)(vm.head + i)] = vm.mem[(Word)(vm.reg + i)];
+			} else if (vm.CELL_COUNT - distance >= target) {
+				for (Word i = target; i-- > 0;) vm.mem[(Word)(vm.head + i)] = vm.mem[(Word)(vm.reg + i)];
+			} else { // overlaps from both sides
+				vector<Word> words(target);
+				for (Word i = 0; i < target; ++i) words[i] = vm.mem[(Word)(vm.reg + i)];
+				for (Word i = 0; i < target; ++i) vm.mem[(Word)(vm.head + i)] = words[i];
+			}
+		}
+	} else if (instr.instr == Ispsh) {
+		vm.head = ++vm.mem[STACK_PTR_CELL];
+		vm.cell() = target;
+	} else if (instr.instr == Ispop) {
+		vm.mem[STACK_PTR_CELL] -= target;
+		vm.head = vm.mem[STACK_PTR_CELL] + 1;
 	} else if (instr.instr == Ioutu) {
-		cout << target;
+		*vm.out << (unsigned long long)target;
 	} else if (instr.instr == Ioutc) {
-		cout << (char)target;
+		*vm.out << (char)target;
 	} else if (instr.instr == Iinc) {
 		char c;
-		cin >> c;
+		*vm.in >> c;
 		inputReg = c;
 	} else if (instr.instr == Iipc) {
-		inputReg = cin.peek();
+		inputReg = vm.in->peek();
 	} else if (instr.instr == Iinu) {
-		cin >> inputReg; // NOTE inu maxes out on overflow
-		cin.clear();
+		*vm.in >> inputReg; // NOTE inu maxes out on overflow
+		vm.in->clear();
 	} else if (instr.instr == Iinl) {
 		char c = 0;
-		while (c != '\n') cin >> c;
+		while (c != '\n') *vm.in >> c;
 	}
 	else unreachable();
 }
-void interpInstr(VM& vm, Instr& instr, bool& ipChanged) {
-	static_assert(RegisterCount == 5 && OperationCount == 10 && sizeof(Suffix) == 4 * 5, "Exhaustive interpInstr definition");
-	unsigned short left, right;
+/// value the instr works with - immediate, register, their operation and modification
+template<typename Word>
+Word interpTarget(BasicVM<Word>& vm, Instr const& instr) {
+	static_assert(RegisterCount == 5 && OperationCount == 12 && sizeof(Suffix) == 4 * 5, "Exhaustive interpTarget definition");
+	Word left, right = 0;
 	if (instr.hasImm()) right = instr.immediate;
 	if (instr.hasOp()) {
 		left = interpGetReg(vm, instr.suffixes.reg);
@@ -1764,31 +2481,720 @@ void interpInstr(VM& vm, Instr& instr, bool& ipChanged) {
 		left = interpGetReg(vm, InstrToModReg[instr.instr]);
 		right = interpOperation(vm, instr.suffixes.modifier, left, right);
 	}
-	bool cond;
+	return right;
+}
+template<typename Word>
+void interpInstr(BasicVM<Word>& vm, Instr const& instr, bool& ipChanged) {
+	Word right = interpTarget(vm, instr);
+	bool cond = false;
 	if (instr.hasCond()) {
-		cond = interpCond(vm, instr, (signed short) right);
+		cond = interpCond(vm, instr, (make_signed_t<Word>) right);
 	}
 	interpInstrBody(vm, instr, right, cond, ipChanged);
 }
+enum RunStatus {
+	RSfinished,
+	RSbudgetExhausted,
+	RSwordBitsMismatch, // the program was compiled for the other VM, nothing was run
+};
+/// execution counts of an interpreted run
+struct Profile {
+	vector<unsigned long long> executed; // per instruction
+	vector<unsigned long long> taken; // per instruction, jumps which changed ip
+
+	Profile(size_t instrCount) : executed(instrCount), taken(instrCount) {}
+	void record(size_t ip, bool ipChanged) {
+		executed[ip]++;
+		if (ipChanged) taken[ip]++;
+	}
+};
+/// memory accesses of an interpreted run, see --memory-report
+/// - segments split memory at their starts, each spans to the next one
+/// - the std heap chunk chain is walked periodically, its peaks are sampled
+struct MemoryMonitor {
+	struct CellAccesses {
+		unsigned long long reads = 0;
+		unsigned long long writes = 0;
+	};
+	struct Segment {
+		string name;
+		size_t start, end;
+		unsigned long long reads = 0;
+		unsigned long long writes = 0;
+		size_t lowestWritten = SIZE_MAX, highestWritten = 0; // addresses, high-water mark of stack-like segments
+	};
+	/// chunks of std/core/heap.mx - header: data_size, flags, then data and footer
+	struct HeapChain {
+		size_t first, end; // first chunk header, end sentinel header
+		size_t overhead, flagOccupied;
+		// last walk
+		size_t chunks = 0, freeChunks = 0, occupiedWords = 0, freeWords = 0, largestFree = 0;
+		size_t extent = 0; // end of the last occupied chunk, relative to first
+		bool consistent = true; // sizes lead exactly to the end sentinel
+		// peaks of consistent walks
+		size_t peakOccupied = 0, peakChunks = 0, peakExtent = 0;
+		unsigned long long walks = 0;
+		unsigned long long inconsistentWalks = 0; // caught mid-update or corrupted
+	};
+	static constexpr int PAGE_BITS = 12;
+	static constexpr unsigned long long HEAP_WALK_INTERVAL = 1024; // min instrs between chain walks
+	static constexpr int STRIDE_BUCKETS = 33; // 0, 1, 2-3, 4-7, .., 2**31-2**32-1
+
+	size_t cellCount;
+	vector<unique_ptr<CellAccesses[]>> pages; // allocated on the first access
+	vector<Segment> segments; // by start, the first one starts at 0
+	optional<HeapChain> heap;
+	unsigned long long strides[STRIDE_BUCKETS] = {}; // distances between consecutive accesses, log2 buckets
+	size_t lastAddr = 0;
+	unsigned long long untilWalk = 0;
+
+	MemoryMonitor(size_t cellCount, vector<pair<string, size_t>> starts, optional<HeapChain> heap) :
+			cellCount(cellCount), pages(((cellCount - 1) >> PAGE_BITS) + 1), heap(heap) {
+		stable_sort(starts.begin(), starts.end(), [](auto& a, auto& b) { return a.second < b.second; });
+		if (starts.empty() || starts[0].second) starts.insert(starts.begin(), {"-", 0});
+		for (int i = 0; i < starts.size(); ++i) {
+			size_t end = i+1 < starts.size() ? starts[i+1].second : cellCount;
+			if (starts[i].second < end) segments.push_back({starts[i].first, starts[i].second, end});
+		}
+	}
+	CellAccesses* cellAccesses(size_t addr) {
+		unique_ptr<CellAccesses[]>& page = pages[addr >> PAGE_BITS];
+		return page ? &page[addr & ((1 << PAGE_BITS) - 1)] : nullptr;
+	}
+	Segment& segmentOf(size_t addr) {
+		return *prev(upper_bound(segments.begin(), segments.end(), addr, [](size_t addr, Segment& s) { return addr < s.start; }));
+	}
+	void access(size_t addr, bool write) {
+		unique_ptr<CellAccesses[]>& page = pages[addr >> PAGE_BITS];
+		if (!page) page = make_unique<CellAccesses[]>(1 << PAGE_BITS);
+		CellAccesses& cell = page[addr & ((1 << PAGE_BITS) - 1)];
+		Segment& segment = segmentOf(addr);
+		if (write) {
+			cell.writes++;
+			segment.writes++;
+			segment.lowestWritten = min(segment.lowestWritten, addr);
+			segment.highestWritten = max(segment.highestWritten, addr);
+		} else {
+			cell.reads++;
+			segment.reads++;
+		}
+		size_t bucket = 0; // bits of the distance
+		for (size_t distance = addr > lastAddr ? addr - lastAddr : lastAddr - addr; distance; distance >>= 1) bucket++;
+		strides[bucket]++;
+		lastAddr = addr;
+	}
+	/// records cells accessed by instr, to be called before it is executed
+	template<typename Word>
+	void record(BasicVM<Word>& vm, Instr const& instr) {
+		static_assert(InstructionCount == 18, "Exhaustive MemoryMonitor::record definition");
+		bool input = instr.instr == Iinc || instr.instr == Iipc || instr.instr == Iinu;
+		bool readsHead = (instr.hasReg() && instr.suffixes.reg == Rm && !input)
+			|| (instr.hasMod() && InstrToModReg[instr.instr] == Rm)
+			|| (instr.hasCond() && instr.suffixes.condReg == Rm);
+		if (readsHead) access(vm.head, false);
+
+		if (instr.instr == Istr || instr.instr == Is || (input && instr.suffixes.reg == Rm)) {
+			access(vm.head, true);
+		} else if (instr.instr == Iswap) {
+			access(vm.head, false);
+			access(vm.head, true);
+		} else if (instr.instr == Ifill || instr.instr == Icopy) {
+			Word count = interpTarget(vm, instr);
+			for (Word i = 0; i < count; ++i) {
+				if (instr.instr == Icopy) access((Word)(vm.reg + i), false);
+				access((Word)(vm.head + i), true);
+			}
+		} else if (instr.instr == Ispsh) {
+			access(STACK_PTR_CELL, false);
+			access(STACK_PTR_CELL, true);
+			access((Word)(vm.mem[STACK_PTR_CELL] + 1), true);
+		} else if (instr.instr == Ispop) {
+			access(STACK_PTR_CELL, false);
+			access(STACK_PTR_CELL, true);
+		}
+		if (heap && !untilWalk--) walkHeap(vm.mem);
+	}
+	/// updates the chain usage from memory, schedules the next walk so that walks stay a fraction of the run
+	template<typename Word>
+	void walkHeap(Word* mem) {
+		HeapChain& chain = *heap;
+		chain.walks++;
+		chain.chunks = chain.freeChunks = chain.occupiedWords = chain.freeWords = chain.largestFree = chain.extent = 0;
+		chain.consistent = false;
+		for (size_t header = chain.first; header+1 < cellCount; ) {
+			if (header == chain.end) {
+				chain.consistent = true;
+				break;
+			}
+			size_t size = mem[header];
+			size_t next = header + size + chain.overhead;
+			if (next > chain.end) break;
+			chain.chunks++;
+			if (mem[header+1] == chain.flagOccupied) {
+				chain.occupiedWords += size;
+				chain.extent = next - chain.first;
+			} else {
+				chain.freeChunks++;
+				chain.freeWords += size;
+				chain.largestFree = max(chain.largestFree, size);
+			}
+			header = next;
+		}
+		if (chain.consistent) {
+			chain.peakOccupied = max(chain.peakOccupied, chain.occupiedWords);
+			chain.peakChunks = max(chain.peakChunks, chain.chunks);
+			chain.peakExtent = max(chain.peakExtent, chain.extent);
+		} else chain.inconsistentWalks++;
+		untilWalk = max<unsigned long long>(HEAP_WALK_INTERVAL, 8 * chain.chunks);
+	}
+	/// final heap walk, the state at exit
+	template<typename Word>
+	void finish(BasicVM<Word>& vm) {
+		if (heap) walkHeap(vm.mem);
+	}
+};
+/// runs instrs on vm from its current ip
+/// @param budget: max number of executed instructions, 0 for unlimited
+/// @param profile: optional execution counts to update
+/// @param monitor: optional memory accesses to update
+template<typename Word>
+RunStatus execute(BasicVM<Word>& vm, vector<Instr> const& instrs, unsigned long long budget=0, Profile* profile=nullptr, MemoryMonitor* monitor=nullptr) {
+	vm.in->unsetf(ios_base::skipws); // set stdin to not ignore whitespace
+	unsigned long long executed = 0;
+	for (; vm.ip < instrs.size(); ++executed) {
+		if (budget && executed == budget) break;
+		bool ipChanged = false;
+		Word ip = vm.ip;
+		if (monitor) monitor->record(vm, instrs[ip]);
+		interpInstr(vm, instrs[ip], ipChanged);
+		if (!ipChanged) vm.ip++;
+		if (profile) profile->record(ip, ipChanged);
+	}
+	vm.steps += executed;
+	return vm.ip < instrs.size() ? RSbudgetExhausted : RSfinished;
+}
 void interpret(int startIdx) {
-	globalVm.start(startIdx);
-	cin.unsetf(ios_base::skipws); // set cin to not ignore whitespace
-	while (globalVm.ip < parseCtx.instrs.size()) {
+	comp->withVM([&](auto& vm) {
+		vm.start(startIdx);
+		execute(vm, comp->parseCtx.instrs);
+	});
+}
+const unsigned long long PREINIT_BUDGET = 100'000'000; // max instrs run at compile time
+/// program state after its deterministic start was run at compile time
+struct Preinit {
+	VM& vm; // executable starts from its head, reg, ip and memory
+	string output; // written before the snapshot
+};
+/// runs the program from begin until the first input instr, label preinit_end or budget
+/// @return false if the snapshot can't be used
+bool preinitialize(Preinit& preinit, ParseCtx& parseCtx) {
+	static_assert(InstructionCount == 18, "Exhaustive preinitialize definition");
+	VM& vm = preinit.vm;
+	vector<Instr>& instrs = parseCtx.instrs;
+	int stop = parseCtx.strToLabel.count("preinit_end") ? parseCtx.strToLabel["preinit_end"].addr : -1;
+	vm.reset();
+	vm.load(parseCtx.data);
+	ostringstream output;
+	ostream* out = vm.out;
+	vm.out = &output;
+	for (; vm.ip < instrs.size() && vm.ip != stop && vm.steps < PREINIT_BUDGET; ++vm.steps) {
+		InstrNames instr = instrs[vm.ip].instr;
+		if (instr == Iinc || instr == Iipc || instr == Iinu || instr == Iinl) break;
 		bool ipChanged = false;
-		interpInstr(globalVm, parseCtx.instrs[globalVm.ip], ipChanged);
-		if (!ipChanged) globalVm.ip++;
+		interpInstr(vm, instrs[vm.ip], ipChanged);
+		if (!ipChanged) vm.ip++;
 	}
+	vm.out = out;
+	preinit.output = output.str();
+	return vm.ip <= instrs.size(); // the executable reports out of bounds jumps
+}
+// profiling -------------------------------------------------
+void checkCond(bool cond, string message);
+string padLeft(string s, size_t width) {
+	return string(width - min(width, s.size()), ' ') + s;
+}
+/// share of count in total, one decimal place
+string percentOf(unsigned long long count, unsigned long long total) {
+	return to_string(count * 1000 / max(total, 1ULL) / 10) + '.' + to_string(count * 1000 / max(total, 1ULL) % 10) + '%';
+}
+/// expansions which produced the instr, outermost first
+vector<int> expansionChain(vector<ExpansionFrame>& expansions, Instr& instr) {
+	vector<int> chain;
+	for (int id = instr.expansionId; id != -1; id = expansions[id].parent) chain.push_back(id);
+	reverse(chain.begin(), chain.end());
+	return chain;
+}
+/// instructions and macros sorted by execution count
+/// - macro counts are inclusive, recursive expansions counted once
+void writeProfileReport(ofstream& outFile, Profile& profile, vector<Instr>& instrs, vector<ExpansionFrame>& expansions) {
+	unsigned long long total = accumulate(profile.executed.begin(), profile.executed.end(), 0ULL);
+	auto percent = [&](unsigned long long count) { return percentOf(count, total); };
+	vector<int> order;
+	map<string, unsigned long long> macroCounts;
+	for (int idx = 0; idx < instrs.size(); ++idx) {
+		if (!profile.executed[idx]) continue;
+		order.push_back(idx);
+		set<string> macros;
+		for (int id : expansionChain(expansions, instrs[idx])) macros.insert(expansions[id].name);
+		for (string const& name : macros) macroCounts[name] += profile.executed[idx];
+	}
+	stable_sort(order.begin(), order.end(), [&](int a, int b) { return profile.executed[a] > profile.executed[b]; });
+	outFile << "; executed instructions: " << total << "\n\n";
+
+	outFile << "; executed   share  taken  idx  location  instruction  (expansions, innermost first)\n";
+	for (int idx : order) {
+		Instr& instr = instrs[idx];
+		outFile << padLeft(to_string(profile.executed[idx]), 10) << padLeft(percent(profile.executed[idx]), 8)
+			<< padLeft(to_string(profile.taken[idx]), 7) << padLeft(to_string(idx), 5) << "  "
+			<< instr.opcodeLoc.toStr() << "  " << instr.toStr();
+		for (int id = instr.expansionId; id != -1; id = expansions[id].parent) {
+			outFile << (id == instr.expansionId ? "  (" : ", ") << expansions[id].toStr();
+		}
+		outFile << (instr.expansionId != -1 ? ")\n" : "\n");
+	}
+	vector<pair<string, unsigned long long>> macros(macroCounts.begin(), macroCounts.end());
+	stable_sort(macros.begin(), macros.end(), [](auto& a, auto& b) { return a.second > b.second; });
+	outFile << "\n; executed   share  macro\n";
+	for (auto& [name, count] : macros) {
+		outFile << padLeft(to_string(count), 10) << padLeft(percent(count), 8) << "  %" << name << '\n';
+	}
+}
+/// one line per distinct expansion stack: '<outermost>;...;<instr> <count>', as consumed by flamegraph tools
+void writeFoldedStacks(ofstream& outFile, Profile& profile, vector<Instr>& instrs, vector<ExpansionFrame>& expansions) {
+	auto frameStr = [](string frame) {
+		replace(frame.begin(), frame.end(), ';', ',');
+		return frame;
+	};
+	map<string, unsigned long long> stacks;
+	for (int idx = 0; idx < instrs.size(); ++idx) {
+		if (!profile.executed[idx]) continue;
+		string stack;
+		for (int id : expansionChain(expansions, instrs[idx])) stack += frameStr(expansions[id].toStr()) + ';';
+		stack += frameStr(instrs[idx].opcodeLoc.toStr() + ' ' + instrs[idx].toStr());
+		stacks[stack] += profile.executed[idx];
+	}
+	for (auto& [stack, count] : stacks) outFile << stack << ' ' << count << '\n';
+}
+/// totals, per segment accesses and written span, std heap chain usage, access strides and the hottest cells
+void writeMemoryReport(ofstream& outFile, MemoryMonitor& monitor) {
+	const int HOTTEST_CELLS = 16;
+	unsigned long long reads = 0, writes = 0;
+	size_t touched = 0;
+	vector<pair<unsigned long long, size_t>> hottest; // min heap of accesses, address
+	for (size_t addr = 0; addr < monitor.cellCount; ++addr) {
+		MemoryMonitor::CellAccesses* cell = monitor.cellAccesses(addr);
+		if (!cell) {
+			addr |= (1 << MemoryMonitor::PAGE_BITS) - 1; // untouched page
+			continue;
+		}
+		if (!cell->reads && !cell->writes) continue;
+		reads += cell->reads;
+		writes += cell->writes;
+		touched++;
+		hottest.push_back({cell->reads + cell->writes, addr});
+		push_heap(hottest.begin(), hottest.end(), greater<>());
+		if (hottest.size() > HOTTEST_CELLS) {
+			pop_heap(hottest.begin(), hottest.end(), greater<>());
+			hottest.pop_back();
+		}
+	}
+	outFile << "; memory accesses: " << reads + writes << ", reads: " << reads << ", writes: " << writes
+		<< ", cells touched: " << touched << "\n\n";
+
+	outFile << "; segment                 start       size       reads      writes  written span  (peak use)\n";
+	for (MemoryMonitor::Segment& segment : monitor.segments) {
+		outFile << segment.name << string(max<int>(1, 20 - (int)segment.name.size()), ' ') << padLeft(to_string(segment.start), 10)
+			<< padLeft(to_string(segment.end - segment.start), 11) << padLeft(to_string(segment.reads), 12) << padLeft(to_string(segment.writes), 12) << "  ";
+		if (!segment.writes) {
+			outFile << "-\n";
+			continue;
+		}
+		outFile << segment.lowestWritten << ".." << segment.highestWritten
+			<< "  (" << percentOf(segment.highestWritten + 1 - segment.start, segment.end - segment.start) << ')'
+			<< (segment.highestWritten + 1 == segment.end ? "  FULL\n" : "\n");
+	}
+	if (monitor.heap) {
+		MemoryMonitor::HeapChain& chain = *monitor.heap;
+		outFile << "\n; heap chunk chain " << chain.first << ".." << chain.end << ", " << chain.walks << " walks";
+		if (chain.inconsistentWalks) outFile << " (" << chain.inconsistentWalks << " caught mid-update)";
+		outFile << "\n; peak: " << chain.peakOccupied << " occupied words, " << chain.peakChunks << " chunks, extent " << chain.peakExtent
+			<< " words (" << percentOf(chain.peakExtent, chain.end - chain.first) << ")\n";
+		if (chain.consistent) {
+			outFile << "; at exit: " << chain.occupiedWords << " occupied words, " << chain.chunks << " chunks, " << chain.freeChunks
+				<< " free (" << chain.freeWords << " words), largest free " << chain.largestFree << ", fragmentation "
+				<< percentOf(chain.freeWords - chain.largestFree, chain.freeWords) << '\n';
+		} else outFile << "; at exit: chunk sizes don't lead to the end sentinel, the heap is corrupted\n";
+	}
+
+	unsigned long long accesses = accumulate(begin(monitor.strides), end(monitor.strides), 0ULL);
+	outFile << "\n; stride                    accesses   share\n";
+	for (int bucket = 0; bucket < MemoryMonitor::STRIDE_BUCKETS; ++bucket) {
+		if (!monitor.strides[bucket]) continue;
+		string range = bucket < 2 ? to_string(bucket) : to_string(1ULL << (bucket-1)) + '-' + to_string((1ULL << bucket) - 1);
+		outFile << range << string(max<int>(1, 22 - (int)range.size()), ' ') << padLeft(to_string(monitor.strides[bucket]), 12)
+			<< padLeft(percentOf(monitor.strides[bucket], accesses), 8) << '\n';
+	}
+
+	sort_heap(hottest.begin(), hottest.end(), greater<>());
+	outFile << "\n; accesses     reads    writes  address  segment\n";
+	for (auto [count, addr] : hottest) {
+		MemoryMonitor::CellAccesses* cell = monitor.cellAccesses(addr);
+		MemoryMonitor::Segment& segment = monitor.segmentOf(addr);
+		outFile << padLeft(to_string(count), 10) << padLeft(to_string(cell->reads), 10) << padLeft(to_string(cell->writes), 10)
+			<< padLeft(to_string(addr), 9) << "  " << segment.name << '+' << addr - segment.start << '\n';
+	}
+}
+/// binary heatmap, host byte order: "MXHM", u32 version 1, u32 word bits, u64 cells per row, u64 rows,
+/// then u64 reads and u64 writes of each row of consecutive cells
+void writeHeatmap(fs::path heatmapPath, MemoryMonitor& monitor, unsigned wordBits) {
+	const unsigned long long ROWS = min<size_t>(4096, monitor.cellCount);
+	unsigned long long cellsPerRow = monitor.cellCount / ROWS;
+	vector<unsigned long long> counts(2 * ROWS);
+	for (size_t addr = 0; addr < monitor.cellCount; ++addr) {
+		MemoryMonitor::CellAccesses* cell = monitor.cellAccesses(addr);
+		if (!cell) {
+			addr |= (1 << MemoryMonitor::PAGE_BITS) - 1;
+			continue;
+		}
+		counts[2 * (addr / cellsPerRow)] += cell->reads;
+		counts[2 * (addr / cellsPerRow) + 1] += cell->writes;
+	}
+	ofstream heatmapFile(heatmapPath, ios::binary);
+	checkCond(heatmapFile.good(), "The output file" + errorQuoted(heatmapPath.string()) + " couldn't be opened");
+	unsigned version = 1;
+	heatmapFile.write("MXHM", 4);
+	heatmapFile.write((char*)&version, sizeof(version));
+	heatmapFile.write((char*)&wordBits, sizeof(wordBits));
+	heatmapFile.write((char*)&cellsPerRow, sizeof(cellsPerRow));
+	heatmapFile.write((char*)&ROWS, sizeof(ROWS));
+	heatmapFile.write((char*)counts.data(), counts.size() * sizeof(unsigned long long));
+}
+/// code size attributed to macros, sorted by total instructions, then the expansion chain of every instruction
+/// - self counts come directly from the macro body, totals include nested expansions
+/// - recursive expansions of a macro are counted once in its totals
+/// - expansions inside ctime expansions are left out, their code only runs at compile time
+void writeExpansionReport(ofstream& outFile, vector<Instr>& instrs, vector<ExpansionFrame>& expansions) {
+	struct MacroCosts {
+		string name;
+		Loc defLoc;
+		unsigned long long expansions = 0, selfInstrs = 0, totalInstrs = 0, selfTokens = 0, totalTokens = 0;
+	};
+	map<string, MacroCosts> macros; // by definition loc & name
+	auto macroKey = [](ExpansionFrame& frame) { return frame.defLoc.toStr() + ' ' + frame.name; };
+	auto outermostOfMacro = [&](int id) { // not nested in another expansion of the same macro
+		for (int above = expansions[id].parent; above != -1; above = expansions[above].parent) {
+			if (macroKey(expansions[above]) == macroKey(expansions[id])) return false;
+		}
+		return true;
+	};
+	vector<unsigned long long> subtreeTokens(expansions.size());
+	for (int id = expansions.size()-1; id >= 0; --id) { // nested expansions always follow their parent
+		subtreeTokens[id] += expansions[id].tokens;
+		if (expansions[id].parent != -1 && !expansions[id].ctime) subtreeTokens[expansions[id].parent] += subtreeTokens[id];
+	}
+	size_t programExpansions = 0;
+	for (int id = 0; id < expansions.size(); ++id) {
+		if (expansions[id].ctime) continue;
+		programExpansions++;
+		MacroCosts& costs = macros[macroKey(expansions[id])];
+		costs.name = expansions[id].name;
+		costs.defLoc = expansions[id].defLoc;
+		costs.expansions++;
+		costs.selfTokens += expansions[id].tokens;
+		if (outermostOfMacro(id)) costs.totalTokens += subtreeTokens[id];
+	}
+	for (Instr& instr : instrs) {
+		set<string> seen;
+		for (int id = instr.expansionId; id != -1; id = expansions[id].parent) {
+			string key = macroKey(expansions[id]);
+			if (id == instr.expansionId) macros[key].selfInstrs++;
+			if (seen.insert(key).second) macros[key].totalInstrs++;
+		}
+	}
+	vector<MacroCosts> sorted;
+	for (auto& [key, costs] : macros) sorted.push_back(costs);
+	stable_sort(sorted.begin(), sorted.end(), [](MacroCosts const& a, MacroCosts const& b) { return a.totalInstrs > b.totalInstrs; });
+
+	outFile << "; instructions: " << instrs.size() << ", expansions: " << programExpansions << "\n\n";
+	outFile << "; expansions  self instrs  total instrs  self tokens  total tokens  macro  definition\n";
+	for (MacroCosts& costs : sorted) {
+		outFile << padLeft(to_string(costs.expansions), 12) << padLeft(to_string(costs.selfInstrs), 13) << padLeft(to_string(costs.totalInstrs), 14)
+			<< padLeft(to_string(costs.selfTokens), 13) << padLeft(to_string(costs.totalTokens), 14) << "  %" << costs.name << "  " << costs.defLoc.toStr() << '\n';
+	}
+	outFile << "\n; idx  location  instruction  (expansions, innermost first)\n";
+	for (int idx = 0; idx < instrs.size(); ++idx) {
+		Instr& instr = instrs[idx];
+		outFile << padLeft(to_string(idx), 5) << "  " << instr.opcodeLoc.toStr() << "  " << instr.toStr();
+		for (int id = instr.expansionId; id != -1; id = expansions[id].parent) {
+			outFile << (id == instr.expansionId ? "  (" : ", ") << expansions[id].toStr();
+		}
+		outFile << (instr.expansionId != -1 ? ")\n" : "\n");
+	}
+}
+/// jump destination known at compile time, -1 if computed or out of bounds
+int immediateJumpTarget(Instr& instr, size_t instrCount) {
+	if (!instr.hasImm() || instr.hasReg() || instr.hasOp() || instr.hasMod()) return -1;
+	if (instr.immediate < 0 || instr.immediate > instrCount) return -1;
+	return instr.immediate;
+}
+/// marks the first instructions of basic blocks: label addresses, immediate jump targets, instructions after jumps
+/// - indirect jumps may still enter a block elsewhere, std calls return right after their jump
+vector<bool> blockLeaders(vector<Instr>& instrs) {
+	vector<bool> leaders(instrs.size() + 1);
+	leaders[0] = true;
+	for (auto& [name, label] : comp->parseCtx.strToLabel) {
+		if (label.addr >= 0 && label.addr <= instrs.size()) leaders[label.addr] = true;
+	}
+	for (int i = 0; i < instrs.size(); ++i) {
+		Instr& instr = instrs[i];
+		if (instr.instr != Ijmp && instr.instr != Ib) continue;
+		leaders[i+1] = true;
+		int target = immediateJumpTarget(instr, instrs.size());
+		if (target != -1) leaders[target] = true;
+	}
+	return leaders;
+}
+// dead code elimination
+bool readsP(Instr& instr) {
+	return instr.suffixes.reg == Rp || (instr.hasMod() && InstrToModReg[instr.instr] == Rp) || (instr.hasCond() && instr.suffixes.condReg == Rp);
+}
+/// target of a jmp relative to p by an immediate, -1 if not such a jmp or it lands past any instruction
+int relativeJumpTarget(Instr& instr, int instrNum) {
+	if (instr.instr != Ijmp || !instr.hasImm() || instr.hasReg() || instr.hasOp()) return -1;
+	long long target = -1;
+	if (instr.suffixes.modifier == OPa) target = (instrNum + instr.immediate) & comp->wordMaxVal();
+	if (instr.suffixes.modifier == OPs) target = (instrNum - instr.immediate) & comp->wordMaxVal();
+	return target <= numeric_limits<int>::max() ? target : -1;
+}
+/// index of the first jmp at or after i, instrs.size() if there is none
+int nextJmp(vector<Instr>& instrs, int i) {
+	while (i < instrs.size() && instrs[i].instr != Ijmp) i++;
+	return i;
+}
+/// whether instrs[i] is the return address store of a std call: spsh <k>, strap, ..., jmp, <strap + k>
+bool storesReturnAddress(vector<Instr>& instrs, int i) {
+	Instr& instr = instrs[i];
+	if (i == 0 || instr.instr != Istr || instr.suffixes.modifier != OPa || instr.suffixes.reg != Rp || instr.hasImm()) return false;
+	Instr& offset = instrs[i-1];
+	if (offset.instr != Ispsh || offset.hasReg() || offset.hasOp() || !offset.hasImm() || offset.immediates.front().type == Talpha) return false;
+	return i + offset.immediate == nextJmp(instrs, i) + 1;
+}
+/// whether instrs[i] makes a code address out of a number, which can't be renumbered
+/// - p reads other than relative jumps by an immediate & std call returns
+/// - numeric immediates loaded into r for the jmpr / br closing the block
+bool loadsCodeAddress(vector<Instr>& instrs, int i) {
+	Instr& instr = instrs[i];
+	if (readsP(instr)) return relativeJumpTarget(instr, i) == -1 && !storesReturnAddress(instrs, i);
+	if (instr.instr != Ild || instr.hasReg() || instr.hasOp() || instr.hasMod() || instr.immediates.front().type == Talpha) return false;
+	for (int j = i + 1; j < instrs.size(); ++j) {
+		Instr& next = instrs[j];
+		if (next.instr == Ijmp || next.instr == Ib) return next.suffixes.reg == Rr && !next.hasImm();
+		if (next.instr == Ild || next.instr == Iswap || ((next.instr == Iinc || next.instr == Iinu || next.instr == Iipc) && next.suffixes.reg == Rr)) return false;
+	}
+	return false;
+}
+/// drops instrs unreachable from begin, renumbers labels & jump targets, returns the number of dropped instrs
+/// - reachable: fall through, immediate & relative jump targets, label immediates (any of them may be jumped to),
+/// 	the instr after the first jmp following a p read (return address of std calls)
+/// - nothing is dropped if a reachable instr loads a code address as a number, see loadsCodeAddress
+int eliminateDeadCode(ParseCtx& parseCtx) {
+	vector<Instr>& instrs = parseCtx.instrs;
+	int n = instrs.size();
+	vector<bool> reachable(n + 1);
+	vector<int> worklist;
+	auto reach = [&](int i) {
+		if (i < 0 || i > n || reachable[i]) return;
+		reachable[i] = true;
+		worklist.push_back(i);
+	};
+	reach(0);
+	while (worklist.size()) {
+		int i = worklist.back(); worklist.pop_back();
+		if (i == n) continue;
+		Instr& instr = instrs[i];
+		if (instr.hasImm() && instr.immediates.front().type == Talpha) reach(instr.immediate);
+		if (instr.instr == Ijmp || instr.instr == Ib) reach(immediateJumpTarget(instr, n));
+		reach(relativeJumpTarget(instr, i));
+		if (loadsCodeAddress(instrs, i)) {
+			if (comp->flags.verbose) *comp->out << "[NOTE] --strip-dead keeps all code, a code address is loaded as a number: " << instr.opcodeLoc.toStr() << " " << instr.toStr() << '\n';
+			return 0;
+		}
+		if (readsP(instr)) reach(nextJmp(instrs, i) + 1);
+		if (instr.instr != Ijmp) reach(i + 1);
+	}
+	vector<int> newIdx(n + 1); // of the first kept instr at or after
+	for (int i = 0; i < n; ++i) newIdx[i+1] = newIdx[i] + reachable[i];
+	if (newIdx[n] == n) return 0;
+
+	for (auto& [name, label] : parseCtx.strToLabel) {
+		if (label.addr >= 0 && label.addr <= n) label.addr = newIdx[label.addr];
+	}
+	vector<Instr> kept;
+	for (int i = 0; i < n; ++i) {
+		if (!reachable[i]) continue;
+		Instr& instr = instrs[i];
+		int relTarget = relativeJumpTarget(instr, i);
+		if (instr.hasImm() && instr.immediates.front().type == Talpha) {
+			instr.immediate = parseCtx.strToLabel[instr.immediates.front().data].addr;
+		} else if (relTarget >= 0 && relTarget <= n) {
+			int distance = newIdx[relTarget] - newIdx[i];
+			instr.immediate = (instr.suffixes.modifier == OPa ? distance : -distance) & comp->wordMaxVal();
+		} else if ((instr.instr == Ijmp || instr.instr == Ib) && immediateJumpTarget(instr, n) != -1) {
+			instr.immediate = newIdx[instr.immediate];
+		}
+		kept.push_back(move(instr));
+	}
+	instrs = move(kept);
+	parseCtx.instrsToReparse.clear();
+	return n - instrs.size();
+}
+/// retargets immediate jumps landing on an unconditional immediate jmp to its final destination, returns the number of retargeted jumps
+/// - chains of jmps are followed to the first non-jmp instr, jumps into a chain ending in a cycle are left alone
+int threadJumps(ParseCtx& parseCtx) {
+	vector<Instr>& instrs = parseCtx.instrs;
+	int n = instrs.size();
+	auto trampolineTarget = [&](int i) { // -1 if instrs[i] isn't a jmp to a known instr
+		if (i >= n || instrs[i].instr != Ijmp) return -1;
+		return immediateJumpTarget(instrs[i], n);
+	};
+	const int CYCLIC = -1, UNKNOWN = -2, ON_CHAIN = -3;
+	vector<int> destination(n, UNKNOWN); // per trampoline: end of its chain, each resolved once
+	vector<int> chain;
+	for (int start = 0; start < n; ++start) {
+		if (destination[start] != UNKNOWN || trampolineTarget(start) == -1) continue;
+		int end = start, dest;
+		while (true) {
+			chain.push_back(end);
+			destination[end] = ON_CHAIN;
+			int next = trampolineTarget(end);
+			if (trampolineTarget(next) == -1) dest = next;
+			else if (destination[next] == ON_CHAIN) dest = CYCLIC;
+			else if (destination[next] != UNKNOWN) dest = destination[next];
+			else {
+				end = next;
+				continue;
+			}
+			break;
+		}
+		for (int t : chain) destination[t] = dest; // chains leading into a cycle are cyclic as well
+		chain.clear();
+	}
+	int threaded = 0;
+	for (int i = 0; i < n; ++i) {
+		Instr& instr = instrs[i];
+		if (instr.instr != Ijmp && instr.instr != Ib) continue;
+		int target = immediateJumpTarget(instr, n);
+		if (target == -1 || trampolineTarget(target) == -1 || destination[target] == CYCLIC) continue;
+		if (destination[target] == instr.immediate) continue;
+		instr.immediate = destination[target];
+		threaded++;
+	}
+	return threaded;
 }
-// assembly generation ------------------------------------------
-void genRegisterFetch(ofstream& outFile, RegNames reg, int instrNum, bool toSecond=true) {
+/// counts file: per instruction block counter (valid at block leaders), then per instruction taken jumps
+/// - written by --profile and by executables built with --instrument
+Profile readCounts(fs::path countsPath, vector<Instr>& instrs) {
+	ifstream countsFile(countsPath, ios::binary);
+	checkCond(countsFile.good(), "The counts file" + errorQuoted(countsPath.string()) + " couldn't be opened");
+	raiseErrors();
+	vector<unsigned long long> counters(2 * instrs.size());
+	countsFile.read((char*)counters.data(), counters.size() * sizeof(unsigned long long));
+	checkCond(countsFile.gcount() == counters.size() * sizeof(unsigned long long) && countsFile.peek() == EOF,
+		"The counts file" + errorQuoted(countsPath.string()) + " doesn't match the program");
+	raiseErrors();
+
+	Profile profile(instrs.size());
+	vector<bool> leaders = blockLeaders(instrs);
+	unsigned long long blockCount = 0;
+	for (int i = 0; i < instrs.size(); ++i) {
+		if (leaders[i]) blockCount = counters[i];
+		profile.executed[i] = blockCount;
+		profile.taken[i] = counters[instrs.size() + i];
+	}
+	return profile;
+}
+void writeCounts(fs::path countsPath, Profile& profile) {
+	ofstream countsFile(countsPath, ios::binary);
+	checkCond(countsFile.good(), "The output file" + errorQuoted(countsPath.string()) + " couldn't be opened");
+	countsFile.write((char*)profile.executed.data(), profile.executed.size() * sizeof(unsigned long long));
+	countsFile.write((char*)profile.taken.data(), profile.taken.size() * sizeof(unsigned long long));
+}
+/// placement of basic blocks guided by execution counts
+/// - hot blocks are chained so that their more frequent successor falls through
+/// - never executed blocks are cold, placed into a separate section in source order
+struct BlockLayout {
+	vector<int> hot; // block starts in placement order, ends with the instrs.size() pseudo block
+	vector<int> cold;
+	vector<int> placedNext; // per block start: start of the block placed right after it in the same section, -1 if none
+	vector<int> blockEnd; // per block start: idx after its last instr
+
+	BlockLayout(vector<Instr>& instrs, Profile& profile) {
+		vector<bool> leaders = blockLeaders(instrs);
+		leaders[instrs.size()] = true;
+		blockEnd = vector<int>(instrs.size() + 1, -1);
+		vector<int> starts;
+		for (int i = 0; i <= instrs.size(); ++i) {
+			if (!leaders[i]) continue;
+			if (starts.size()) blockEnd[starts.back()] = i;
+			starts.push_back(i);
+		}
+		vector<bool> placed(instrs.size() + 1);
+		placed[instrs.size()] = true;
+		for (int start : starts) {
+			for (int b = start; b != -1 && !placed[b] && (profile.executed[b] || b == 0); b = hotSuccessor(instrs, profile, b)) {
+				hot.push_back(b);
+				placed[b] = true;
+			}
+		}
+		hot.push_back(instrs.size());
+		for (int start : starts) {
+			if (!placed[start]) cold.push_back(start);
+		}
+		placedNext = vector<int>(instrs.size() + 1, -1);
+		for (int i = 0; i+1 < hot.size(); ++i) placedNext[hot[i]] = hot[i+1];
+		for (int i = 0; i+1 < cold.size(); ++i) placedNext[cold[i]] = cold[i+1];
+	}
+	/// more frequently executed successor of the block, -1 if unknown
+	int hotSuccessor(vector<Instr>& instrs, Profile& profile, int start) {
+		int last = blockEnd[start] - 1;
+		Instr& instr = instrs[last];
+		int target = immediateJumpTarget(instr, instrs.size());
+		if (instr.instr == Ijmp) return target;
+		if (instr.instr == Ib && target != -1 && profile.taken[last] * 2 > profile.executed[last]) return target;
+		return last + 1;
+	}
+};
+/// operands sized to the target word, 16-bit words live in the low halves of the 32-bit registers
+struct WordAsm {
+	int size; // bytes, also the cell index scale
+	string c, b, a, d, si, di; // rcx, rbx, rax, rdx, rsi, rdi
+	string h, r; // r14, r15
+	string cell; // cells[r14]
+	string ptr, data, strSuffix; // 'WORD PTR', '.short', 'w' of stosw
+	string maxVal;
+	/// zero extending move into a 64-bit register
+	string zx(string dst64, string src) const {
+		if (size == 2) return "movzx " + dst64 + ", " + src;
+		return "mov " + (isdigit(dst64[1]) ? dst64 + 'd' : 'e' + dst64.substr(1)) + ", " + src;
+	}
+};
+WordAsm const& wordAsm() {
+	static const WordAsm word16{2, "cx", "bx", "ax", "dx", "si", "di", "r14w", "r15w", "[2*r14+r13]", "WORD PTR", ".short", "w", "65535"};
+	static const WordAsm word32{4, "ecx", "ebx", "eax", "edx", "esi", "edi", "r14d", "r15d", "[4*r14+r13]", "DWORD PTR", ".long", "d", "4294967295"};
+	return comp->flags.wordBits == 32 ? word32 : word16;
+}
+void genRegisterFetch(ostream& outFile, RegNames reg, int instrNum, bool toSecond=true) {
 	static_assert(RegisterCount == 5, "Exhaustive genRegisterFetch definition");
+	WordAsm const& w = wordAsm();
 	string regName = toSecond ? "rcx" : "rbx";
-	string shortReg = toSecond ? "cx" : "bx";
+	string shortReg = toSecond ? w.c : w.b;
 	if (reg == Rh) {
 		outFile << "	mov " << regName <<", r14\n";
-	} else if (reg == Rm) {
+	} else if (reg == Rm && w.size == 2) {
 		outFile << "	xor " << regName << ", " << regName << "\n"
-			"	mov " << shortReg << ", [2*r14+r13]\n";
+			"	mov " << shortReg << ", " << w.cell << "\n";
+	} else if (reg == Rm) {
+		outFile << "	mov " << shortReg << ", " << w.cell << "\n";
 	} else if (reg == Rr) {
 		outFile << "	mov " << regName <<", r15\n";
 	} else if (reg == Rp) {
@@ -1797,17 +3203,29 @@ void genRegisterFetch(ofstream& outFile, RegNames reg, int instrNum, bool toSeco
 		unreachable();
 	}
 }
-void genOperation(ofstream& outFile, OpNames op) {
-	static_assert(OperationCount == 10, "Exhaustive genOperation definition");
+void genOperation(ostream& outFile, OpNames op) {
+	static_assert(OperationCount == 12, "Exhaustive genOperation definition");
+	WordAsm const& w = wordAsm();
 	if (op == OPa) {
-		outFile << "	add cx, bx\n";
+		outFile << "	add " << w.c << ", " << w.b << "\n";
 	} else if (op == OPs) {
-		outFile << "	sub bx, cx\n"
+		outFile << "	sub " << w.b << ", " << w.c << "\n"
 			"	mov rcx, rbx\n";
 	} else if (op == OPt) {
 		outFile << "	mov rax, rbx\n"
 			"	mul rcx\n"
-			"	mov cx, ax\n";
+			"	mov " << w.c << ", " << w.a << "\n";
+	} else if (op == OPd || op == OPo) {
+		outFile << "	" << w.zx("rax", w.b) << "\n"
+			"	" << w.zx("rcx", w.c) << "\n"
+			<< (op == OPd ? "	mov ebx, " + w.maxVal + " # divided by zero\n" : "	mov ebx, eax # modulo zero\n") <<
+			"	xor edx, edx\n"
+			"	test ecx, ecx\n"
+			"	jz 1f\n"
+			"	div ecx\n"
+			<< (op == OPd ? "	mov ebx, eax\n" : "	mov ebx, edx\n") <<
+			"1:\n"
+			"	mov ecx, ebx\n";
 	} else if (op == OPand) {
 		outFile << "	and rcx, rbx\n";
 	} else if (op == OPor) {
@@ -1815,13 +3233,13 @@ void genOperation(ofstream& outFile, OpNames op) {
 	} else if (op == OPxor) {
 		outFile << "	xor rcx, rbx\n";
 	} else if (op == OPshl) {
-		outFile << "	shl bx, cl\n"
-			"	movzx rcx, bx\n";
+		outFile << "	shl " << w.b << ", cl\n"
+			"	" << w.zx("rcx", w.b) << "\n";
 	} else if (op == OPshr) {
-		outFile << "	shr bx, cl\n"
+		outFile << "	shr " << w.b << ", cl\n"
 			"	mov rcx, rbx\n";
 	} else if (op == OPbit) {
-		outFile << "	shr bx, cl\n"
+		outFile << "	shr " << w.b << ", cl\n"
 			"	mov rcx, rbx\n"
 			"	and rcx, 1\n";
 	} else {
@@ -1842,6 +3260,20 @@ map<CondNames, string> _jmpInstr {
 	{Cbl, "jae"},
 	{Cbe, "ja"},
 };
+static_assert(ConditionCount == 11, "Exhaustive _branchJmpInstr definition");
+map<CondNames, string> _branchJmpInstr { // jumps if condition holds, after 'cmp bx, 0'
+	{Ceq, "je"},
+	{Cne, "jne"},
+	{Clt, "js"},
+	{Cle, "jle"},
+	{Cgt, "jg"},
+	{Cge, "jns"},
+
+	{Cab, "ja"},
+	{Cae, "jae"},
+	{Cbl, "jb"},
+	{Cbe, "jbe"},
+};
 static_assert(ConditionCount == 11, "Exhaustive _condLoadInstr definition");
 map<CondNames, string> _condLoadInstr {
 	{Ceq, "sete"},
@@ -1856,38 +3288,41 @@ map<CondNames, string> _condLoadInstr {
 	{Cbl, "setb"},
 	{Cbe, "setbe"},
 };
-void genCond(ofstream& outFile, InstrNames instr, RegNames condReg, CondNames cond, int instrNum) {
+void genCond(ostream& outFile, InstrNames instr, RegNames condReg, CondNames cond, int instrNum) {
 	static_assert(ConditionCount == 11, "Exhaustive genCond definition");
+	WordAsm const& w = wordAsm();
 	genRegisterFetch(outFile, condReg, -1, false);
 	if (instr == Ib) {
-		outFile << "	cmp bx, 0\n"
+		outFile << "	cmp " << w.b << ", 0\n"
 		"	" << _jmpInstr[cond] << " instr_" << instrNum + 1 << "\n";
 	} else if (instr == Il) {
 		outFile <<
 			"	xor r15, r15\n"
-			"	cmp bx, cx\n"
+			"	cmp " << w.b << ", " << w.c << "\n"
 			"	" << _condLoadInstr[cond] << " r15b\n";
 	} else if (instr == Is) {
 		outFile <<
 			"	xor rax, rax\n"
-			"	cmp bx, cx\n"
+			"	cmp " << w.b << ", " << w.c << "\n"
 			"	" << _condLoadInstr[cond] << " al\n"
-			"	mov [2*r14+r13], ax\n";
+			"	mov " << w.cell << ", " << w.a << "\n";
 	} else {
 		unreachable();
 	}
 }
-void genInstrBody(ofstream& outFile, InstrNames instr, int instrNum, bool inputToR=true) {
-	static_assert(InstructionCount == 14, "Exhaustive genInstrBody definition");
-	string inputDest = inputToR ? "r15w" : "[2*r14+r13]";
+void genInstrBody(ostream& outFile, InstrNames instr, int instrNum, bool inputToR=true) {
+	static_assert(InstructionCount == 18, "Exhaustive genInstrBody definition");
+	WordAsm const& w = wordAsm();
+	string inputDest = inputToR ? w.r : w.cell;
 
 	if (instr == Imov) {
 		outFile << "	mov r14, rcx\n";
 	} else if (instr == Istr) {
-		outFile << "	mov [2*r14+r13], cx\n";
+		outFile << "	mov " << w.cell << ", " << w.c << "\n";
 	} else if (instr == Ild) {
 		outFile << "	mov r15, rcx\n";
 	} else if (instr == Ijmp || instr == Ib) {
+		if (comp->flags.instrument) outFile << "	inc QWORD PTR [rip + taken_counters + " << 8*instrNum << "]\n";
 		outFile <<
 		"	mov rsi, " << instrNum << "\n"
 		"	cmp rcx, OFFSET FLAT:instruction_count\n"
@@ -1896,9 +3331,23 @@ void genInstrBody(ofstream& outFile, InstrNames instr, int instrNum, bool inputT
 		"	jmp [rbx+8*rcx]\n";
 	} else if (instr == Il || instr == Is) { // handled in genCond
 	} else if (instr == Iswap) {
-		outFile << "	mov cx, [2*r14+r13]\n"
-			"	mov [2*r14+r13], r15w\n"
-			"	mov r15w, cx\n";
+		outFile << "	mov " << w.c << ", " << w.cell << "\n"
+			"	mov " << w.cell << ", " << w.r << "\n"
+			"	mov " << w.r << ", " << w.c << "\n";
+	} else if (instr == Ifill) {
+		outFile << "	call block_fill\n";
+	} else if (instr == Icopy) {
+		outFile << "	call block_copy\n";
+	} else if (instr == Ispsh) {
+		outFile << "	" << w.zx("r14", w.ptr + " [r13]") << "\n"
+			"	inc " << w.h << "\n"
+			"	mov [r13], " << w.h << "\n"
+			"	mov " << w.cell << ", " << w.c << "\n";
+	} else if (instr == Ispop) {
+		outFile << "	" << w.zx("r14", w.ptr + " [r13]") << "\n"
+			"	sub " << w.h << ", " << w.c << "\n"
+			"	mov [r13], " << w.h << "\n"
+			"	inc " << w.h << "\n";
 	} else if (instr == Ioutu) {
 		outFile << "	mov rax, rcx\n"
 			"	call print_unsigned\n";
@@ -1910,22 +3359,23 @@ void genInstrBody(ofstream& outFile, InstrNames instr, int instrNum, bool inputT
 			"	call stdout_write\n";
 	} else if (instr == Iinc) {
 		outFile << "	call get_next_char\n"
-			"	mov " << inputDest << ", dx\n";
+			"	mov " << inputDest << ", " << w.d << "\n";
 	} else if (instr == Iipc) {
 		outFile << "	call stdin_peek\n"
-			"	mov " << inputDest << ", dx\n";
+			"	mov " << inputDest << ", " << w.d << "\n";
 	} else if (instr == Iinu) {
 		outFile << "	call input_unsigned\n"
-			"	mov " << inputDest << ", ax\n";
+			"	mov " << inputDest << ", " << w.a << "\n";
 	} else if (instr == Iinl) {
-		outFile << "	call get_next_char\n"
+		outFile << "1:\n"
+			"	call get_next_char\n"
 			"	cmp rdx, 10\n"
-			"	jne instr_" << instrNum << "\n";
+			"	jne 1b\n";
 	} else {
 		unreachable();
 	}
 }
-void genAssembly(ofstream& outFile, Instr instr, int instrNum) {
+void genAssembly(ostream& outFile, Instr instr, int instrNum) {
 	// head pos - r14, internal r reg - r15
 	// operands - first - rbx, second - rcx (also result of operation)
 	// addr of cells[0] - r13
@@ -1951,8 +3401,549 @@ void genAssembly(ofstream& outFile, Instr instr, int instrNum) {
 	}
 	genInstrBody(outFile, instr.instr, instrNum, instr.suffixes.reg == Rr);
 }
+/// JSON string contents, UTF-8 sequences and control chars as \uXXXX escapes, other bytes taken as Latin-1
+string jsonStringEscaped(string s) {
+	string out;
+	auto escape = [&](unsigned codepoint) {
+		char buf[8];
+		snprintf(buf, sizeof(buf), "\\u%04x", codepoint & 0xffff); // called with UTF-16 code units
+		out += buf;
+	};
+	for (size_t i = 0; i < s.size(); ++i) {
+		unsigned char c = s[i];
+		if (c == '\\' || c == '"') {
+			out.push_back('\\');
+			out.push_back(c);
+			continue;
+		} else if (c >= 0x20 && c < 0x80) {
+			out.push_back(c);
+			continue;
+		}
+		int length = c >= 0xf0 && c < 0xf8 ? 4 : c >= 0xe0 && c < 0xf0 ? 3 : c >= 0xc0 && c < 0xe0 ? 2 : 1;
+		unsigned codepoint = length == 1 ? c : c & (0x7f >> length);
+		for (int j = 1; j < length; ++j) {
+			if (i+j >= s.size() || (s[i+j] & 0xc0) != 0x80) { // not UTF-8
+				length = 1;
+				codepoint = c;
+				break;
+			}
+			codepoint = codepoint << 6 | (s[i+j] & 0x3f);
+		}
+		if (codepoint >= 0x10000) { // surrogate pair
+			escape(0xd800 + ((codepoint - 0x10000) >> 10));
+			escape(0xdc00 + ((codepoint - 0x10000) & 0x3ff));
+		} else escape(codepoint);
+		i += length - 1;
+	}
+	return out;
+}
+string asmStringEscaped(string s) {
+	string out;
+	for (char c : s) {
+		if (c == '\\' || c == '"') out.push_back('\\');
+		out.push_back(c);
+	}
+	return out;
+}
+// debug info
+#ifdef _WIN32
+#define ASM_SECTION_OFFSET ".secrel32"
+#else
+#define ASM_SECTION_OFFSET ".long"
+#endif
+/// declares DWARF file numbers of all source files referenced by instrs and their expansions
+map<string, int> genDebugFiles(ofstream& outFile, vector<Instr>& instrs) {
+	map<string, int> fileIds;
+	auto addFile = [&](string file) {
+		if (fileIds.count(file)) return;
+		int id = fileIds.size() + 1;
+		fileIds[file] = id;
+		fs::path path = comp->parseCtx.moduleFiles.count(file) ? comp->parseCtx.moduleFiles[file] : fs::path(file);
+		outFile << "	.file " << id << " \"" << asmStringEscaped(path.string()) << "\"\n";
+	};
+	for (Instr& instr : instrs) addFile(instr.opcodeLoc.file);
+	for (ExpansionFrame& frame : comp->parseCtx.expansions) addFile(frame.loc.file);
+	return fileIds;
+}
+void genInstrHeader(ofstream& outFile, Instr& instr, int instrNum, map<string, int>& fileIds) {
+	outFile << "instr_" << instrNum << ":\n";
+	outFile << "	# " << instr.toStr() << '\n';
+	if (fileIds.size()) outFile << "	.loc " << fileIds[instr.opcodeLoc.file] << ' ' << instr.opcodeLoc.row << ' ' << instr.opcodeLoc.col << '\n';
+}
+/// DWARF debug info with an inlined subroutine for each macro expansion which produced instrs
+/// - code spans instr_0 upto instr_<instrs.size()> in source order
+/// - expansions are not contiguous, instrs from macro arguments belong to the caller
+void genDebugInlineInfo(ofstream& outFile, vector<Instr>& instrs, map<string, int>& fileIds) {
+	vector<ExpansionFrame>& expansions = comp->parseCtx.expansions;
+	vector<vector<pair<int, int>>> ranges(expansions.size()); // [first, last) instr spans
+	for (int i = 0; i < instrs.size(); ++i) {
+		for (int id = instrs[i].expansionId; id != -1; id = expansions[id].parent) {
+			if (ranges[id].size() && ranges[id].back().second == i) ranges[id].back().second++;
+			else ranges[id].push_back(pair(i, i+1));
+		}
+	}
+	map<int, vector<int>> children; // -1 for top level
+	map<string, int> macroIds;
+	for (int id = 0; id < expansions.size(); ++id) {
+		if (ranges[id].empty()) continue;
+		children[expansions[id].parent].push_back(id);
+		macroIds.insert(pair(expansions[id].name, macroIds.size()));
+	}
+	outFile <<
+		"\n"
+		".section .debug_abbrev\n"
+		".Ldebug_abbrev0:\n"
+		"	.uleb128 1, 0x11, 1 # compile unit\n"
+		"	.uleb128 0x25, 0x08, 0x13, 0x05, 0x03, 0x08, 0x1b, 0x08, 0x10, 0x17, 0x11, 0x01, 0x12, 0x07, 0, 0\n"
+		"	.uleb128 2, 0x2e, 1 # program subprogram\n"
+		"	.uleb128 0x03, 0x08, 0x11, 0x01, 0x12, 0x07, 0, 0\n"
+		"	.uleb128 3, 0x2e, 0 # macro, abstract subprogram\n"
+		"	.uleb128 0x03, 0x08, 0x20, 0x0b, 0, 0\n"
+		"	.uleb128 4, 0x1d, 1 # macro expansion, inlined subroutine\n"
+		"	.uleb128 0x31, 0x13, 0x55, 0x17, 0x58, 0x0f, 0x59, 0x0f, 0x57, 0x0f, 0, 0\n"
+		"	.uleb128 5, 0x1d, 0 # innermost macro expansion\n"
+		"	.uleb128 0x31, 0x13, 0x55, 0x17, 0x58, 0x0f, 0x59, 0x0f, 0x57, 0x0f, 0, 0\n"
+		"	.byte 0\n"
+		".section .debug_line\n"
+		".Ldebug_line0:\n"
+		".section .debug_info\n"
+		".Ldebug_info0:\n"
+		"	.long .Ldebug_info_end - .Ldebug_info_start\n"
+		".Ldebug_info_start:\n"
+		"	.short 4 # DWARF version\n"
+		"	" ASM_SECTION_OFFSET " .Ldebug_abbrev0\n"
+		"	.byte 8 # address size\n"
+		"	.uleb128 1\n"
+		"	.asciz \"Masfix\"\n"
+		"	.short 0x8001 # DW_LANG_Mips_Assembler\n"
+		"	.asciz \"" << asmStringEscaped(comp->parseCtx.mainPath.string()) << "\"\n"
+		"	.asciz \"" << asmStringEscaped(fs::current_path().string()) << "\"\n"
+		"	" ASM_SECTION_OFFSET " .Ldebug_line0\n"
+		"	.quad instr_0\n"
+		"	.quad instr_" << instrs.size() << " - instr_0\n"
+		"	.uleb128 2\n"
+		"	.asciz \"" TOP_MODULE_NAME "\"\n"
+		"	.quad instr_0\n"
+		"	.quad instr_" << instrs.size() << " - instr_0\n";
+	function<void(int)> genExpansion = [&](int id) {
+		ExpansionFrame& frame = expansions[id];
+		bool innermost = children[id].empty();
+		outFile <<
+			"	.uleb128 " << (innermost ? 5 : 4) << " # %" << frame.name << "\n"
+			"	.long .Ldebug_macro_" << macroIds[frame.name] << " - .Ldebug_info0\n"
+			"	" ASM_SECTION_OFFSET " .Ldebug_ranges_" << id << "\n"
+			"	.uleb128 " << fileIds[frame.loc.file] << ", " << frame.loc.row << ", " << frame.loc.col << "\n";
+		if (innermost) return;
+		for (int child : children[id]) genExpansion(child);
+		outFile << "	.byte 0\n";
+	};
+	for (int id : children[-1]) genExpansion(id);
+	outFile << "	.byte 0\n";
+	for (auto& [name, macroId] : macroIds) {
+		outFile <<
+			".Ldebug_macro_" << macroId << ":\n"
+			"	.uleb128 3\n"
+			"	.asciz \"" << asmStringEscaped(name) << "\"\n"
+			"	.byte 1 # DW_INL_inlined\n";
+	}
+	outFile <<
+		"	.byte 0\n"
+		".Ldebug_info_end:\n"
+		".section .debug_ranges\n";
+	for (int id = 0; id < expansions.size(); ++id) {
+		if (ranges[id].empty()) continue;
+		outFile << ".Ldebug_ranges_" << id << ":\n";
+		for (auto [first, last] : ranges[id]) {
+			outFile << "	.quad instr_" << first << " - instr_0, instr_" << last << " - instr_0\n";
+		}
+		outFile << "	.quad 0, 0\n";
+	}
+	outFile << "\n";
+}
+/// instruction ending a block of the --profile-use layout
+/// - immediate jumps and branches jump directly, branches are inverted when their target is placed next
+/// - jumps to the fall through successor if it is not placed next
+void genBlockEnd(ofstream& outFile, Instr& instr, int instrNum, int placedNext, size_t instrCount) {
+	int target = immediateJumpTarget(instr, instrCount);
+	bool fallsThrough = true;
+	if (instr.instr == Ijmp && target != -1) {
+		if (target != placedNext) outFile << "	jmp instr_" << target << '\n';
+		return;
+	} else if (instr.instr == Ib && target != -1 && instr.hasCond()) {
+		genRegisterFetch(outFile, instr.suffixes.condReg, instrNum, false);
+		outFile << "	cmp bx, 0\n";
+		if (target == placedNext) {
+			outFile << "	" << _jmpInstr[instr.suffixes.cond] << " instr_" << instrNum + 1 << '\n';
+			return;
+		}
+		outFile << "	" << _branchJmpInstr[instr.suffixes.cond] << " instr_" << target << '\n';
+	} else {
+		genAssembly(outFile, instr, instrNum);
+		fallsThrough = instr.instr != Ijmp;
+	}
+	if (fallsThrough && instrNum + 1 != placedNext) outFile << "	jmp instr_" << instrNum + 1 << '\n';
+}
+/// emits blocks of one section in the given order
+void genBlocks(ofstream& outFile, vector<Instr>& instrs, BlockLayout& layout, vector<int>& blocks, map<string, int>& fileIds) {
+	for (int start : blocks) {
+		if (start == instrs.size()) continue;
+		for (int i = start; i < layout.blockEnd[start]; ++i) {
+			genInstrHeader(outFile, instrs[i], i, fileIds);
+			if (i+1 < layout.blockEnd[start]) genAssembly(outFile, instrs[i], i);
+			else genBlockEnd(outFile, instrs[i], i, layout.placedNext[start], instrs.size());
+		}
+	}
+}
+// outlining
+/// repeated instruction sequence emitted once, called from each site
+struct OutlinedSeq {
+	int length;
+	vector<int> sites; // first instrs
+};
+/// finds repeated straight-line sequences of at least minLength instrs with identical assembly
+/// - only the first instr of a site may be a block leader, jumps are never outlined
+/// - greedy, the most frequent sequences first, then extended as long as all sites agree
+vector<OutlinedSeq> findOutlinedSeqs(vector<Instr>& instrs, vector<bool>& leaders, int minLength) {
+	int n = instrs.size();
+	vector<int> ids(n); // equal for identical assembly, -1 for jumps
+	map<string, int> codeIds;
+	for (int i = 0; i < n; ++i) {
+		if (instrs[i].instr == Ijmp || instrs[i].instr == Ib) {
+			ids[i] = -1;
+			continue;
+		}
+		ostringstream code;
+		genAssembly(code, instrs[i], i);
+		ids[i] = codeIds.insert(pair(code.str(), codeIds.size())).first->second;
+	}
+	vector<bool> covered(n);
+	auto continues = [&](int i) { return i < n && ids[i] != -1 && !leaders[i] && !covered[i]; };
+
+	map<vector<int>, vector<int>> windows;
+	for (int start = 0; start + minLength <= n; ++start) {
+		if (ids[start] == -1) continue;
+		int len = 1;
+		while (len < minLength && continues(start + len)) len++;
+		if (len == minLength) windows[vector<int>(ids.begin() + start, ids.begin() + start + minLength)].push_back(start);
+	}
+	vector<vector<int>*> groups;
+	for (auto& [window, starts] : windows) {
+		if (starts.size() > 1) groups.push_back(&starts);
+	}
+	stable_sort(groups.begin(), groups.end(), [](vector<int>* a, vector<int>* b) { return a->size() > b->size(); });
 
-void generate(ofstream& outFile, vector<Instr>& instrs) {
+	vector<OutlinedSeq> seqs;
+	for (vector<int>* starts : groups) {
+		OutlinedSeq seq{minLength, {}};
+		for (int start : *starts) {
+			bool free = seq.sites.empty() || start >= seq.sites.back() + minLength;
+			for (int i = start; i < start + minLength && free; ++i) free = !covered[i];
+			if (free) seq.sites.push_back(start);
+		}
+		if (seq.sites.size() < 2) continue;
+		while (true) {
+			bool extends = true;
+			for (int idx = 0; idx < seq.sites.size() && extends; ++idx) {
+				int next = seq.sites[idx] + seq.length;
+				extends = continues(next) && ids[next] == ids[seq.sites[0] + seq.length] &&
+					(idx+1 == seq.sites.size() || next < seq.sites[idx+1]);
+			}
+			if (!extends) break;
+			seq.length++;
+		}
+		for (int site : seq.sites) {
+			fill(covered.begin() + site, covered.begin() + site + seq.length, true);
+		}
+		seqs.push_back(seq);
+	}
+	return seqs;
+}
+/// memory with the words placed by %static, zeroed elsewhere
+void genInitializedCells(ofstream& outFile, map<unsigned, unsigned>& data) {
+	outFile <<
+		".data\n"
+		"	.balign 8\n"
+		"	cells: # memory initialized by %static\n";
+	int next = 0, onLine = 0;
+	for (auto [addr, value] : data) {
+		if (addr != next) {
+			outFile << (onLine ? "\n" : "") << "	.skip 2 * " << addr - next << '\n';
+			onLine = 0;
+		}
+		outFile << (onLine ? ", " : "	.short ") << value;
+		if (++onLine == 16) {
+			outFile << '\n';
+			onLine = 0;
+		}
+		next = addr + 1;
+	}
+	if (onLine) outFile << '\n';
+	if (next < CELLS) outFile << "	.skip 2 * " << CELLS - next << '\n';
+	outFile << '\n';
+}
+/// runs of the words placed by %static, copied into the allocated cells at start
+/// - run: .quad count, address, .long words, the last run is empty
+void genCellsInit(ofstream& outFile, map<unsigned, unsigned>& data) {
+	outFile <<
+		".data\n"
+		"	.balign 8\n"
+		"	cells_init: # runs of memory initialized by %static\n";
+	for (auto itr = data.begin(); itr != data.end();) {
+		auto runEnd = itr;
+		size_t count = 0;
+		while (runEnd != data.end() && runEnd->first == itr->first + count) ++runEnd, ++count;
+		outFile << "	.quad " << count << ", " << itr->first;
+		for (size_t i = 0; itr != runEnd; ++itr, ++i) outFile << (i % 16 ? ", " : "\n	.long ") << itr->second;
+		outFile << '\n';
+	}
+	outFile << "	.quad 0, 0\n\n";
+}
+/// routine writing all counters into the counts file on exit, keeps rax
+void genCountersDump(ofstream& outFile, size_t instrCount) {
+	outFile <<
+		".extern CreateFileA\n"
+		".extern CloseHandle\n"
+		"dump_counters: # writes block and taken jump counters into the counts file, regs unsafe except rax!\n"
+		"	push rax\n"
+		"	mov r12, rsp\n"
+		"	and rsp, -16 # force 16-byte alignment\n"
+		"	lea rcx, [rip + counts_path]\n"
+		"	mov rdx, 0x40000000 # GENERIC_WRITE\n"
+		"	xor r8, r8 # no sharing\n"
+		"	xor r9, r9 # default security\n"
+		"	sub rsp, 8 # keep alignment\n"
+		"	push 0 # no template file\n"
+		"	push 128 # FILE_ATTRIBUTE_NORMAL\n"
+		"	push 2 # CREATE_ALWAYS\n"
+		"	sub rsp, 32 # reserve shadow space\n"
+		"	call CreateFileA\n"
+		"	mov rsp, r12\n"
+		"	cmp rax, -1 # INVALID_HANDLE_VALUE\n"
+		"	je dump_counters_end\n"
+		"	mov QWORD PTR [rip + counts_fd], rax\n"
+		"	mov rcx, rax\n"
+		"	lea rdx, [rip + block_counters]\n"
+		"	mov r8, " << 2*8*instrCount << "\n"
+		"	call write_file\n"
+		"	and rsp, -16 # force 16-byte alignment\n"
+		"	sub rsp, 32 # reserve shadow space\n"
+		"	mov rcx, QWORD PTR [rip + counts_fd]\n"
+		"	call CloseHandle\n"
+		"	mov rsp, r12\n"
+		"dump_counters_end:\n"
+		"	pop rax\n"
+		"	ret\n"
+		"\n";
+}
+/// fill and copy of cx words, wrapping around the end of cells
+void genBlockRoutines(ofstream& outFile) {
+	WordAsm const& w = wordAsm();
+	string S = to_string(w.size);
+	unsigned long long cellCount = comp->wordMaxVal() + 1;
+	outFile <<
+		"block_fill: # fills cx words from cells[r14] with r15w, wraps around\n"
+		"	" << w.zx("rcx", w.c) << "\n"
+		"	" << w.zx("rdi", w.h) << "\n"
+		"	mov " << w.a << ", " << w.r << "\n"
+		"	mov r8, " << cellCount << "\n"
+		"	lea rdx, [rdi + rcx] # words past the end of cells\n"
+		"	sub rdx, r8\n"
+		"	jle block_fill_tail\n"
+		"	sub rcx, rdx\n"
+		"	lea rdi, [r13 + " << S << "*rdi]\n"
+		"	rep stos" << w.strSuffix << "\n"
+		"	mov rcx, rdx\n"
+		"	xor rdi, rdi\n"
+		"block_fill_tail:\n"
+		"	lea rdi, [r13 + " << S << "*rdi]\n"
+		"	rep stos" << w.strSuffix << "\n"
+		"	ret\n"
+		"block_copy: # copies cx words from cells[r15] to cells[r14] like memmove, wraps around\n"
+		"	" << w.zx("rcx", w.c) << "\n"
+		"	" << w.zx("rsi", w.r) << "\n"
+		"	" << w.zx("rdi", w.h) << "\n"
+		"	mov r8, " << cellCount << "\n"
+		"	lea rax, [rsi + rcx]\n"
+		"	lea rdx, [rdi + rcx]\n"
+		"	cmp rax, rdx\n"
+		"	cmova rdx, rax\n"
+		"	cmp rdx, r8\n"
+		"	ja block_copy_wrapped\n"
+		"	cmp rdi, rsi\n"
+		"	ja block_copy_backward\n"
+		"	lea rsi, [r13 + " << S << "*rsi]\n"
+		"	lea rdi, [r13 + " << S << "*rdi]\n"
+		"	rep movs" << w.strSuffix << "\n"
+		"	ret\n"
+		"block_copy_backward: # dest after src, copy from the end\n"
+		"	lea rsi, [r13 + " << S << "*rsi - " << S << "]\n"
+		"	lea rsi, [rsi + " << S << "*rcx]\n"
+		"	lea rdi, [r13 + " << S << "*rdi - " << S << "]\n"
+		"	lea rdi, [rdi + " << S << "*rcx]\n"
+		"	std\n"
+		"	rep movs" << w.strSuffix << "\n"
+		"	cld\n"
+		"	ret\n"
+		"block_copy_wrapped: # word by word, in the direction not overwriting unread words\n"
+		"	mov rdx, rdi\n"
+		"	sub rdx, rsi\n"
+		"	lea rax, [r8 - 1]\n"
+		"	and rdx, rax # distance from src to dest\n"
+		"	cmp rdx, rcx\n"
+		"	jae block_copy_wrapped_forward\n"
+		"	sub r8, rdx\n"
+		"	cmp r8, rcx\n"
+		"	jb block_copy_buffered # overlaps from both sides\n"
+		"	add " << w.si << ", " << w.c << "\n"
+		"	add " << w.di << ", " << w.c << "\n"
+		"block_copy_wrapped_backward:\n"
+		"	dec " << w.si << "\n"
+		"	dec " << w.di << "\n"
+		"	mov " << w.a << ", [r13 + " << S << "*rsi]\n"
+		"	mov [r13 + " << S << "*rdi], " << w.a << "\n"
+		"	dec rcx\n"
+		"	jnz block_copy_wrapped_backward\n"
+		"	ret\n"
+		"block_copy_wrapped_forward:\n"
+		"	mov " << w.a << ", [r13 + " << S << "*rsi]\n"
+		"	mov [r13 + " << S << "*rdi], " << w.a << "\n"
+		"	inc " << w.si << " # wraps in the word size\n"
+		"	inc " << w.di << "\n"
+		"	dec rcx\n"
+		"	jnz block_copy_wrapped_forward\n"
+		"	ret\n"
+		"block_copy_buffered: # loads all words into a buffer first\n";
+	if (w.size == 2) outFile <<
+		"	lea r8, [rip + block_buff]\n";
+	else outFile << // no static buffer for 2^32 words, allocated for the copy
+		"	push rcx\n"
+		"	push rsi\n"
+		"	push rdi\n"
+		"	lea rdx, [4*rcx] # bytes\n"
+		"	xor rcx, rcx\n"
+		"	call alloc_pages\n"
+		"	pop rdi\n"
+		"	pop rsi\n"
+		"	pop rcx\n"
+		"	mov r8, rax\n";
+	outFile <<
+		"	xor rdx, rdx\n"
+		"block_copy_load:\n"
+		"	mov " << w.a << ", [r13 + " << S << "*rsi]\n"
+		"	mov [r8 + " << S << "*rdx], " << w.a << "\n"
+		"	inc " << w.si << "\n"
+		"	inc rdx\n"
+		"	cmp rdx, rcx\n"
+		"	jb block_copy_load\n"
+		"	xor rdx, rdx\n"
+		"block_copy_store:\n"
+		"	mov " << w.a << ", [r8 + " << S << "*rdx]\n"
+		"	mov [r13 + " << S << "*rdi], " << w.a << "\n"
+		"	inc " << w.di << "\n"
+		"	inc rdx\n"
+		"	cmp rdx, rcx\n"
+		"	jb block_copy_store\n";
+	if (w.size == 4) outFile <<
+		"	mov rcx, r8\n"
+		"	call free_pages\n";
+	outFile <<
+		"	ret\n"
+		"\n";
+	if (w.size == 4) outFile <<
+		"alloc_pages: # rdx - bytes -> rax - zeroed pages, regs unsafe!\n"
+		"	xor rcx, rcx # anywhere\n"
+		"	mov r8, 0x3000 # MEM_COMMIT | MEM_RESERVE\n"
+		"	mov r9, 4 # PAGE_READWRITE\n"
+		"	lea rax, [rip + VirtualAlloc]\n"
+		"	call call_winapi\n"
+		"	test rax, rax\n"
+		"	jz alloc_error\n"
+		"	ret\n"
+		"reserve_cells: # rdx - bytes -> r13 - cells, committed by commit_cells once touched, regs unsafe!\n"
+		"	mov [rip + cells_bytes], rdx\n"
+		"	xor rcx, rcx # anywhere\n"
+		"	mov r8, 0x2000 # MEM_RESERVE\n"
+		"	mov r9, 4 # PAGE_READWRITE\n"
+		"	lea rax, [rip + VirtualAlloc]\n"
+		"	call call_winapi\n"
+		"	test rax, rax\n"
+		"	jz alloc_error\n"
+		"	mov [rip + cells_base], rax\n"
+		"	mov r13, rax\n"
+		"	mov rcx, 1 # called first\n"
+		"	lea rdx, [rip + commit_cells]\n"
+		"	lea rax, [rip + AddVectoredExceptionHandler]\n"
+		"	call call_winapi\n"
+		"	test rax, rax\n"
+		"	jz alloc_error\n"
+		"	ret\n"
+		"commit_cells: # vectored exception handler, rcx - EXCEPTION_POINTERS -> eax - -1 continue execution / 0 continue search\n"
+		"	mov rax, [rcx] # ExceptionRecord\n"
+		"	cmp DWORD PTR [rax], 0xC0000005 # EXCEPTION_ACCESS_VIOLATION\n"
+		"	jne commit_cells_search\n"
+		"	mov rcx, [rax + 40] # ExceptionInformation[1] - accessed address\n"
+		"	sub rcx, [rip + cells_base]\n"
+		"	cmp rcx, [rip + cells_bytes]\n"
+		"	jae commit_cells_search\n"
+		"	and rcx, -0x10000 # 64 KiB chunk, reservations are aligned to it\n"
+		"	add rcx, [rip + cells_base]\n"
+		"	mov rdx, 0x10000\n"
+		"	mov r8, 0x1000 # MEM_COMMIT\n"
+		"	mov r9, 4 # PAGE_READWRITE\n"
+		"	sub rsp, 40 # shadow space, aligns the stack\n"
+		"	lea rax, [rip + VirtualAlloc]\n"
+		"	call rax\n"
+		"	add rsp, 40\n"
+		"	test rax, rax\n"
+		"	jz commit_cells_search\n"
+		"	mov eax, -1\n"
+		"	ret\n"
+		"commit_cells_search:\n"
+		"	xor eax, eax\n"
+		"	ret\n"
+		"free_pages: # rcx - pages from alloc_pages, regs unsafe!\n"
+		"	xor rdx, rdx\n"
+		"	mov r8, 0x8000 # MEM_RELEASE\n"
+		"	lea rax, [rip + VirtualFree]\n"
+		"	# fall through to call_winapi\n"
+		"call_winapi: # calls rax with aligned stack & shadow space\n"
+		"	mov rbp, rsp\n"
+		"	and rsp, -16\n"
+		"	sub rsp, 32\n"
+		"	call rax\n"
+		"	mov rsp, rbp\n"
+		"	ret\n"
+		"alloc_error:\n"
+		"	lea rdx, [rip + alloc_error_message]\n"
+		"	mov r8, OFFSET FLAT:alloc_error_message_len\n"
+		"	call stderr_write\n"
+		"	mov rax, 1 # exit(1)\n"
+		"	call exit\n"
+		"\n";
+}
+/// @param preinit: state to start from instead of begin, nullptr for the regular start
+void generate(ofstream& outFile, vector<Instr>& instrs, Preinit* preinit=nullptr) {
+	PhaseTimer timer("generate");
+	bool instrument = comp->flags.instrument;
+	WordAsm const& w = wordAsm();
+	vector<bool> leaders = instrument || comp->flags.outline ? blockLeaders(instrs) : vector<bool>();
+	vector<OutlinedSeq> outlined;
+	vector<int> outlinedAt(instrs.size(), -1); // outlined sequence starting at the instr
+	vector<bool> interior(instrs.size()); // outlined, but not first in its site
+	if (comp->flags.outline) {
+		outlined = findOutlinedSeqs(instrs, leaders, comp->flags.outline);
+		int sites = 0, saved = 0;
+		for (int idx = 0; idx < outlined.size(); ++idx) {
+			for (int site : outlined[idx].sites) {
+				outlinedAt[site] = idx;
+				fill(interior.begin() + site + 1, interior.begin() + site + outlined[idx].length, true);
+			}
+			sites += outlined[idx].sites.size();
+			saved += (outlined[idx].sites.size() - 1) * outlined[idx].length;
+		}
+		if (comp->flags.verbose) *comp->out << "[NOTE] outlined " << outlined.size() << " sequences called from " << sites
+			<< " sites, " << saved << " instrs less emitted\n";
+	}
 	outFile <<
 		".intel_syntax noprefix\n"
 		"\n"
@@ -1960,9 +3951,11 @@ void generate(ofstream& outFile, vector<Instr>& instrs) {
 		".extern GetStdHandle\n"
 		".extern WriteFile\n"
 		".extern ReadFile\n"
+		<< (w.size == 4 ? ".extern VirtualAlloc\n.extern VirtualFree\n.extern AddVectoredExceptionHandler\n" : "") <<
 		"\n"
 		".text\n"
 		"exit: # exits the program with code in rax\n"
+		<< (instrument ? "	call dump_counters\n" : "") <<
 		"	mov rcx, rax\n"
 		"	and rsp, -16 # force 16-byte alignment\n"
 		"	sub rsp, 32\n"
@@ -2104,32 +4097,74 @@ void generate(ofstream& outFile, vector<Instr>& instrs) {
 		"	mul r10\n"
 		"	add rax, rcx # rax = 10 * rax + rcx\n"
 		"\n"
-		"	mov r10, 65535\n"
+		"	mov r10, " << w.maxVal << "\n"
 		"	cmp rax, r10\n"
 		"	cmova rax, r10\n"
 		"	jmp input_unsigned_loop\n"
 		"input_unsigned_end:\n"
 		"	pop rax\n"
 		"	ret\n"
-		"\n"
+		"\n";
+	genBlockRoutines(outFile);
+	outFile <<
 		".global _start\n"
 		"_start:\n"
 		"	# initialization\n"
 		"	call get_std_fds\n"
 		"	mov QWORD PTR [rip + stdin_buff_char_count], 0\n"
 		"	mov QWORD PTR [rip + stdin_buff_chars_read], 0\n"
-		"\n"
-		"	lea r13, QWORD PTR [rip + cells]\n"
+		"\n";
+	if (w.size == 2) outFile <<
+		"	lea r13, QWORD PTR [rip + cells]\n";
+	else outFile << // 2^32 words don't fit an executable image, cells are reserved at start and committed once touched
+		"	mov rdx, " << 4 * (comp->wordMaxVal() + 1) << "\n"
+		"	call reserve_cells\n"
+		"	lea rsi, [rip + cells_init]\n"
+		"cells_init_run: # count, address, words\n"
+		"	mov rcx, [rsi]\n"
+		"	test rcx, rcx\n"
+		"	jz cells_init_end\n"
+		"	mov rdi, [rsi + 8]\n"
+		"	add rsi, 16\n"
+		"	lea rdi, [r13 + 4*rdi]\n"
+		"	rep movsd\n"
+		"	jmp cells_init_run\n"
+		"cells_init_end:\n";
+	if (preinit) {
+		outFile <<
+			"	# pre-initialized state\n"
+			"	mov r14, " << preinit->vm.head << "\n"
+			"	mov r15, " << preinit->vm.reg << "\n";
+		if (preinit->output.size()) outFile <<
+			"	lea rdx, [rip + preinit_output]\n"
+			"	mov r8, " << preinit->output.size() << "\n"
+			"	call stdout_write\n";
+		outFile <<
+			"	jmp instr_" << preinit->vm.ip << "\n"
+			"\n";
+	} else outFile <<
 		"	xor r14, r14\n"
 		"	xor r15, r15\n"
 		"\n";
 
-	Instr instr;
-	for (int i = 0; i < instrs.size(); ++i) {
-		instr = instrs[i];
-		outFile << "instr_" << i << ":\n";
-		outFile << "	# " << instr.toStr() << '\n';
-		genAssembly(outFile, instr, i);
+	map<string, int> fileIds;
+	if (comp->flags.debugInfo) fileIds = genDebugFiles(outFile, instrs);
+	optional<BlockLayout> layout;
+	if (!comp->flags.profileUse.empty()) {
+		Profile profile = readCounts(comp->flags.profileUse, instrs);
+		layout.emplace(instrs, profile);
+		genBlocks(outFile, instrs, *layout, layout->hot, fileIds);
+	} else {
+		Instr instr;
+		for (int i = 0; i < instrs.size(); ++i) {
+			if (interior[i]) continue;
+			instr = instrs[i];
+			genInstrHeader(outFile, instr, i, fileIds);
+			if (instrument && leaders[i]) outFile << "	inc QWORD PTR [rip + block_counters + " << 8*i << "]\n";
+			if (outlinedAt[i] != -1) {
+				outFile << "	call outlined_" << outlinedAt[i] << " # upto instr_" << i + outlined[outlinedAt[i]].length - 1 << '\n';
+			} else genAssembly(outFile, instr, i);
+		}
 	}
 	outFile <<
 		"instr_"<< instrs.size() << ":\n"
@@ -2140,16 +4175,48 @@ void generate(ofstream& outFile, vector<Instr>& instrs) {
 		"	lea rdx, [rip + jmp_error_message]\n"
 		"	mov r8, OFFSET FLAT:jmp_error_message_len\n"
 		"	call error\n"
+		"jmp_outlined_error:\n"
+		"	lea rdx, [rip + jmp_outlined_error_message]\n"
+		"	mov r8, OFFSET FLAT:jmp_outlined_error_message_len\n"
+		"	call error\n"
 		"\n"
 		"end:\n"
 		"	# exit(0)\n"
 		"	mov rax, 0\n"
 		"	call exit\n"
-		"\n"
+		"\n";
+	for (int idx = 0; idx < outlined.size(); ++idx) {
+		OutlinedSeq& seq = outlined[idx];
+		outFile << "outlined_" << idx << ": # " << seq.length << " instrs, called from " << seq.sites.size() << " sites\n";
+		for (int i = seq.sites[0]; i < seq.sites[0] + seq.length; ++i) {
+			outFile << "	# " << instrs[i].toStr() << '\n';
+			genAssembly(outFile, instrs[i], i);
+		}
+		outFile << "	ret\n";
+	}
+	if (outlined.size()) outFile << "\n";
+	if (instrument) genCountersDump(outFile, instrs.size());
+	if (layout) {
+		outFile << ".section .text.unlikely,\"x\"\n";
+		genBlocks(outFile, instrs, *layout, layout->cold, fileIds);
+		outFile << "\n";
+	}
+	if (comp->flags.debugInline) genDebugInlineInfo(outFile, instrs, fileIds);
+	map<unsigned, unsigned> data = comp->parseCtx.data;
+	if (preinit) {
+		data.clear();
+		for (int addr = 0; addr < CELLS; ++addr) {
+			if (preinit->vm.mem[addr]) data[addr] = preinit->vm.mem[addr];
+		}
+	}
+	if (w.size == 4) genCellsInit(outFile, data);
+	else if (data.size()) genInitializedCells(outFile, data);
+	outFile <<
 		".bss\n"
 		"	.balign 8\n"
-		"\n"
-		"	cells: .skip 2 * " << CELLS << " # resw for memory\n"
+		"\n";
+	if (w.size == 2 && data.empty()) outFile << "	cells: .skip 2 * " << CELLS << " # resw for memory\n";
+	outFile <<
 		"	stdin_fd: .skip 8\n"
 		"	stdout_fd: .skip 8\n"
 		"	stderr_fd: .skip 8\n"
@@ -2157,7 +4224,14 @@ void generate(ofstream& outFile, vector<Instr>& instrs) {
 		"	stdin_buff:  .skip STDIN_BUFF_SIZE  # resb\n"
 		"	stdin_buff_chars_read: .skip 8\n"
 		"	stdin_buff_char_count: .skip 8\n"
-		"\n"
+		<< (w.size == 2 ? "	block_buff: .skip 2 * " + to_string(CELLS) + " # wrapped around copy\n" : "	cells_base: .skip 8\n	cells_bytes: .skip 8\n") <<
+		"\n";
+	if (instrument) outFile <<
+		"	counts_fd: .skip 8\n"
+		"	block_counters: .skip " << 8*instrs.size() << " # per block leader\n"
+		"	taken_counters: .skip " << 8*instrs.size() << " # per jump\n"
+		"\n";
+	outFile <<
 		".data\n"
 		"	.equ STDOUT_BUFF_SIZE, " << STDOUT_BUFF_SIZE << "\n"
 		"	.equ STDIN_BUFF_SIZE, " << STDIN_BUFF_SIZE << "\n"
@@ -2168,14 +4242,30 @@ void generate(ofstream& outFile, vector<Instr>& instrs) {
 		"\n"
 		"	jmp_error_message: .ascii \": jmp destination out of bounds: \"\n"
 		"	.equ jmp_error_message_len, . - jmp_error_message\n"
-		"\n"
+		"	jmp_outlined_error_message: .ascii \": jmp destination inside an outlined sequence: \"\n"
+		"	.equ jmp_outlined_error_message_len, . - jmp_outlined_error_message\n"
+		"	alloc_error_message: .ascii \"\\nERROR: memory allocation failed\\n\"\n"
+		"	.equ alloc_error_message_len, . - alloc_error_message\n"
+		"\n";
+	if (preinit && preinit->output.size()) {
+		outFile << "	preinit_output: # written by the pre-initialized start";
+		for (size_t i = 0; i < preinit->output.size(); ++i) {
+			outFile << (i % 16 ? ", " : "\n	.byte ") << (int)(unsigned char)preinit->output[i];
+		}
+		outFile << "\n\n";
+	}
+	if (instrument) outFile <<
+		"	counts_path: .asciz \"" << asmStringEscaped(comp->flags.filePath("counts").string()) << "\"\n"
+		"\n";
+	outFile <<
 		"	# instruction addresses\n"
 		"	.equ instruction_count, " << instrs.size() << "\n"
 		"	instruction_offsets: .quad ";
 
-	outFile << "instr_0";
-	for (int i = 1; i <= instrs.size(); ++i) {
-		outFile << ",instr_" << i;
+	for (int i = 0; i <= instrs.size(); ++i) {
+		if (i) outFile << ',';
+		if (i < instrs.size() && interior[i]) outFile << "jmp_outlined_error";
+		else outFile << "instr_" << i;
 	}
 
 	outFile << "\n";
@@ -2183,19 +4273,44 @@ void generate(ofstream& outFile, vector<Instr>& instrs) {
 }
 // IO ---------------------------------------
 void printUsage() {
-	cout << "usage: Masfix [flags] <masfix-file-path>\n"
+	cout << "usage: Masfix [flags] <masfix-file-path>...\n"
 			"	flags:\n"
 			"		-v / --verbose   - additional compilation messages\n"
 			"		-S / --strict    - disable multiple errors\n"
 			"		-W / --no-warns  - disable warnings\n"
 			"		-N / --no-notes  - disable notes\n"
 			"		-i / --include   - additional include paths\n"
+			"		--no-prefetch    - tokenize included modules only once reached, without worker threads\n"
 			"	mode:\n"
 			"		-r / --run       - run executable after compilation\n"
 			"		-I / --interpret - interpret instead of compile\n"
+			"		--watch          - rerun the program whenever any of its modules changes\n"
+			"		--serve          - resident compiler, reads requests from stdin (input file not expected):\n"
+			"		                   compile <file> | run <file> | interpret <file> [<stdin-file>] | quit\n"
+			"		-j / --jobs <N>  - batch mode, compile all input files on N threads\n"
 			"	side effects:\n"
 			"		-A / --keep-asm  - keep assembly file\n"
-			"		-D / --dump      - (obsolete) dump prepocessed code into file\n";
+			"		-D / --dump      - (obsolete) dump prepocessed code into file\n"
+			"		-P / --profile   - with -I, write execution counts (.prof, .counts) and folded stacks (.folded)\n"
+			"		--memory-report  - with -I, write per segment & cell accesses, std heap usage and access strides (.mem),\n"
+			"		                   access counts by address ranges (.heatmap)\n"
+			"		--segments <NAME=start,...> - --memory-report segments instead of MEMORY_LAYOUT of std, each ends at the next one\n"
+			"		--instrument     - executable counts block executions into .counts file, reported like --profile with -r\n"
+			"		--counts-report <counts-file> - only report counts of an instrumented executable like --profile\n"
+			"		-g / --debug-info - DWARF line info of source locations in the executable\n"
+			"		--debug-inline   - -g with macro expansions described as inlined subroutines\n"
+			"		--expansion-report - instructions & tokens produced by each macro (.expansions)\n"
+			"		--time-report    - time spent in compilation phases & modules, counters and memory estimates\n"
+			"		--time-report-json - --time-report also written into .time.json file\n"
+			"	optimization:\n"
+			"		--profile-use <counts-file> - lay out hot code paths to fall through, move never executed code aside\n"
+			"		--strip-dead     - drop code unreachable from begin, skipped if code addresses come from other than labels and std calls\n"
+			"		--preinit        - run the program start at compile time up to the first input instr or label preinit_end,\n"
+			"		                   the executable starts from the resulting memory image and registers\n"
+			"		--outline <N>    - emit repeated sequences of at least N instrs once and call them,\n"
+			"		                   smaller N favours size, larger N speed, jumps may enter only block leaders\n"
+			"	target:\n"
+			"		--word-bits <16|32> - machine word size, also the number of addressable memory cells (default 16)\n";
 }
 void checkUsage(bool cond, string message) {
 	if (!cond) {
@@ -2239,6 +4354,21 @@ void populateIncludePaths(Flags& flags) {
 	flags.includeFolders.insert(flags.includeFolders.end(), _masfixFolder/"std"/"ds");
 	flags.includeFolders.insert(flags.includeFolders.end(), _masfixFolder);
 }
+/// named segment starts of --segments
+vector<pair<string, size_t>> parseSegmentStarts(string arg) {
+	vector<pair<string, size_t>> starts;
+	stringstream ss(arg);
+	string segment;
+	while (getline(ss, segment, ',')) {
+		size_t eq = segment.find('=');
+		string start = eq == string::npos ? "" : segment.substr(eq+1);
+		checkUsage(eq && start.size() && start.size() <= 10 && start.find_first_not_of("0123456789") == string::npos,
+			"Segment start expected as NAME=address" + errorQuoted(segment));
+		starts.push_back({segment.substr(0, eq), stoull(start)});
+	}
+	checkUsage(starts.size(), "Segment starts expected");
+	return starts;
+}
 Flags processLineArgs(int argc, char *argv[]) {
 	checkUsage(argc >= 2, "Insufficent number of command line args");
 	Flags flags = Flags();
@@ -2253,21 +4383,92 @@ Flags processLineArgs(int argc, char *argv[]) {
 		} else if (arg == "-i" || arg == "--include") {
 			checkUsage(++i < argc, "Include path expected");
 			flags.includeFolders.push_back(checkPathArg(argv[i], false));
+		} else if (arg == "--no-prefetch") {
+			flags.prefetch = false;
 		} else if (arg == "-A" || arg == "--keep-asm") {
 			flags.keepAsm = true;
 		} else if (arg == "-S" || arg == "--strict") {
-			FLAG_strictErrors = true;
+			flags.strictErrors = true;
 		} else if (arg == "-W" || arg == "--no-warns") {
-			FLAG_enableWarnings = false;
+			flags.enableWarnings = false;
 		} else if (arg == "-N" || arg == "--no-notes") {
-			FLAG_enableNotes = false;
+			flags.enableNotes = false;
 		} else if (arg == "-D" || arg == "-d" || arg == "--dump") {
 			flags.dump = true;
+		} else if (arg == "-P" || arg == "--profile") {
+			flags.profile = true;
+		} else if (arg == "--memory-report") {
+			flags.memoryReport = true;
+		} else if (arg == "--segments") {
+			checkUsage(++i < argc, "Segment starts expected");
+			flags.segments = parseSegmentStarts(argv[i]);
+		} else if (arg == "--instrument") {
+			flags.instrument = true;
+		} else if (arg == "--counts-report") {
+			checkUsage(++i < argc, "Counts file path expected");
+			flags.countsReport = checkPathArg(argv[i], true);
+		} else if (arg == "--profile-use") {
+			checkUsage(++i < argc, "Counts file path expected");
+			flags.profileUse = checkPathArg(argv[i], true);
+		} else if (arg == "--strip-dead") {
+			flags.stripDead = true;
+		} else if (arg == "--preinit") {
+			flags.preinit = true;
+		} else if (arg == "--word-bits") {
+			checkUsage(++i < argc && (string(argv[i]) == "16" || string(argv[i]) == "32"), "Word size of 16 or 32 bits expected");
+			flags.wordBits = stoi(argv[i]);
+		} else if (arg == "--outline") {
+			checkUsage(++i < argc && string(argv[i]).find_first_not_of("0123456789") == string::npos && stoi(argv[i]) >= 2, "Minimal outlined sequence length (>= 2) expected");
+			flags.outline = stoi(argv[i]);
+		} else if (arg == "-g" || arg == "--debug-info") {
+			flags.debugInfo = true;
+		} else if (arg == "--debug-inline") {
+			flags.debugInfo = true;
+			flags.debugInline = true;
+		} else if (arg == "--expansion-report") {
+			flags.expansionReport = true;
+		} else if (arg == "--time-report") {
+			flags.timeReport = true;
+		} else if (arg == "--time-report-json") {
+			flags.timeReport = true;
+			flags.timeReportJson = true;
+		} else if (arg == "--serve") {
+			flags.serve = true;
+		} else if (arg == "--watch") {
+			flags.watch = true;
+		} else if (arg == "-j" || arg == "--jobs") {
+			checkUsage(++i < argc && string(argv[i]).find_first_not_of("0123456789") == string::npos && stoi(argv[i]) > 0, "Number of jobs expected");
+			flags.jobs = stoi(argv[i]);
 		} else {
 			checkUsage(arg.at(0) != '-', "Unknown argument" + errorQuoted(arg));
-			flags.inputPath = checkPathArg(arg, true);
+			flags.batchPaths.push_back(checkPathArg(arg, true));
 		}
 	}
+	checkUsage(!flags.profile || (!flags.serve && !flags.watch), "Profiling can't be combined with resident modes");
+	checkUsage(!flags.profile || flags.interpret, "Profiling requires interpretation (-I)");
+	checkUsage(!flags.memoryReport || (!flags.serve && !flags.watch), "Memory report can't be combined with resident modes");
+	checkUsage(!flags.memoryReport || flags.interpret, "Memory report requires interpretation (-I)");
+	checkUsage(flags.segments.empty() || flags.memoryReport, "Segments are used only by the memory report");
+	for (auto& [name, start] : flags.segments) {
+		checkUsage(start >> flags.wordBits == 0, "Segment start outside of memory" + errorQuoted(name));
+	}
+	checkUsage(!flags.instrument || !flags.interpret, "Instrumentation requires compilation");
+	checkUsage(flags.profileUse.empty() || (!flags.interpret && !flags.instrument), "Profile use requires compilation without instrumentation");
+	checkUsage(!flags.debugInline || flags.profileUse.empty(), "Inlined expansions need the source order layout, can't use profile");
+	checkUsage(!flags.outline || (flags.profileUse.empty() && !flags.debugInline), "Outlining can't be combined with profile use nor inlined expansions");
+	checkUsage(!flags.preinit || (!flags.interpret && !flags.instrument && !flags.outline), "Pre-initialization requires compilation without instrumentation nor outlining");
+	checkUsage(!flags.preinit || flags.wordBits == 16, "Pre-initialization supports only 16-bit words");
+	if (flags.serve) {
+		checkUsage(flags.batchPaths.empty() && !flags.watch && !flags.jobs, "Serve mode expects no input file");
+		return flags; // include paths populated for each request
+	}
+	if (flags.batchPaths.size() > 1 || flags.jobs) {
+		checkUsage(!flags.watch && !flags.dump, "Batch mode can't watch nor dump");
+		if (!flags.jobs) flags.jobs = max(1u, thread::hardware_concurrency());
+		return flags; // include paths populated for each input
+	}
+	checkUsage(flags.batchPaths.size(), "Input file path not found");
+	flags.inputPath = flags.batchPaths.front();
 	populateIncludePaths(flags);
 	return flags;
 }
@@ -2286,67 +4487,622 @@ int runCmdEchoed(vector<string> args, Flags& flags, bool exitOnErr=true) {
 		[](string s0, const string& s1) { return s0 += " " + s1; });
 	const char* command = s.c_str();
 	if (flags.verbose) {
-		cout << "[CMD] " << command << '\n';
+		*comp->out << "[CMD] " << command << '\n';
 	}
 	int returnCode = system(command);
 	if (exitOnErr && returnCode) {
-		exit(returnCode);
+		throw CompilationFailed{returnCode};
 	}
 	return returnCode;
 }
 void removeFile(fs::path file) {
 	bool ret = remove(file.string().c_str());
 	if (ret) {
-		cerr << "WARNING: error on removing the file '" << file.filename() << "'\n";
+		*comp->err << "WARNING: error on removing the file '" << file.filename() << "'\n";
 	}
 }
-int compileAndRun(Flags& flags) {
-	runCmdEchoed({
-		"gcc", "-c",
-		"-o", flags.filePathStr("obj"),
-		flags.filePathStr("s")
-	}, flags);
-	runCmdEchoed({
-		"gcc", "-nostartfiles", "-Wl,-e,_start", "-lkernel32",
-		"-o", flags.filePathStr("exe"), "-g", flags.filePathStr("obj")
-	}, flags);
+void assembleAndLink(Flags& flags) {
+	{
+		PhaseTimer timer("assemble");
+		runCmdEchoed({
+			"gcc", "-c",
+			"-o", flags.filePathStr("obj"),
+			flags.filePathStr("s")
+		}, flags);
+	}
+	{
+		PhaseTimer timer("link");
+		runCmdEchoed({
+			"gcc", "-nostartfiles", "-Wl,-e,_start", "-lkernel32",
+			"-o", flags.filePathStr("exe"), "-g", flags.filePathStr("obj")
+		}, flags);
+	}
 	if (flags.keepAsm) {
-		cout << "[NOTE] asm file: " << flags.filePath("s") << ":183:1\n";
+		*comp->out << "[NOTE] asm file: " << flags.filePath("s") << ":183:1\n";
 	} else {
 		removeFile(flags.filePath("s"));
 	}
 	removeFile(flags.filePath("obj"));
+}
+int runExecutable(Flags& flags) {
+	PhaseTimer timer("run");
 	if (flags.run) return runCmdEchoed({flags.filePathStr("exe")}, flags, false);
 	return 0;
 }
+int compileAndRun(Flags& flags) {
+	assembleAndLink(flags);
+	return runExecutable(flags);
+}
 void initParseCtx(Flags& flags, string mainRelPath) {
-	if (flags.dump) parseCtx.dumpFile = openOutputFile(flags.filePath("dump"));
-	parseCtx.strToLabel = {{"begin", Label("begin", 0, Loc(mainRelPath, 1, 1))}, {"end", Label("end", 0, Loc(mainRelPath, 1, 1))}};
+	if (flags.dump) comp->parseCtx.dumpFile = openOutputFile(flags.filePath("dump"));
+	comp->parseCtx.strToLabel = {{"begin", Label("begin", 0, Loc(mainRelPath, 1, 1))}, {"end", Label("end", 0, Loc(mainRelPath, 1, 1))}};
+}
+/// tokenizes, preprocesses and parses the input program into comp->parseCtx
+void compile(Flags& flags, Scope& scope) {
+	// NOTE batch jobs run in parallel already, a single core has nothing to overlap
+	bool prefetch = flags.prefetch && !flags.jobs && thread::hardware_concurrency() > 1;
+	unique_ptr<ModuleLoader> loader = make_unique<ModuleLoader>(flags, prefetch);
+	scope.loader = loader.get();
+	string mainRelPath = tokenizeNewModule(flags.inputPath, scope, true);
+	initParseCtx(flags, mainRelPath);
+
+	{
+		PhaseTimer timer("preprocess");
+		preprocess(scope);
+	}
+	scope.loader = nullptr;
+	loader.reset(); // stops prefetch workers
+	comp->times.ctimeSteps = comp->withVM([](auto& vm) { return vm.steps; });
+
+	comp->parseCtx.close();
+	if (flags.dump) *comp->out << "\n[NOTE] dump file: \"" << flags.filePath("dump").string() << "\"\n";
+	raiseErrors();
+	if (flags.stripDead) {
+		int dropped = eliminateDeadCode(comp->parseCtx);
+		if (flags.verbose) *comp->out << "[NOTE] dropped " << dropped << " unreachable instrs\n";
+	}
+	{
+		PhaseTimer timer("thread jumps");
+		comp->times.threadedJumps = threadJumps(comp->parseCtx);
+	}
+	if (flags.verbose) *comp->out << "[NOTE] threaded " << comp->times.threadedJumps << " jumps\n";
+	if (flags.expansionReport) {
+		ofstream reportFile = openOutputFile(flags.filePath("expansions"));
+		writeExpansionReport(reportFile, comp->parseCtx.instrs, comp->parseCtx.expansions);
+		*comp->out << "[NOTE] expansion report: \"" << flags.filePath("expansions").string() << "\"\n";
+		raiseErrors();
+	}
+}
+void writeProfileFiles(Flags& flags, Profile& profile);
+void writeMemoryFiles(Flags& flags, MemoryMonitor& monitor);
+/// numeric define of a namespace, as std layouts are found
+optional<size_t> namespaceDefine(string namespaceName, string defineName) {
+	for (auto& [id, ns] : comp->namespaces) {
+		if (ns.name != namespaceName || !ns.defines.count(defineName)) continue;
+		string value = ns.defines[defineName].value;
+		if (value.size() && value.size() <= 10 && value.find_first_not_of("0123456789") == string::npos) return stoull(value);
+	}
+	return nullopt;
 }
-void run(Flags& flags) {
+/// monitor of --segments or the MEMORY_LAYOUT segments of std, with the std heap chunk chain if included
+MemoryMonitor memoryMonitor(Flags& flags, size_t cellCount) {
+	vector<pair<string, size_t>> starts = flags.segments;
+	if (starts.empty()) {
+		for (auto& [id, ns] : comp->namespaces) {
+			if (ns.name != "MEMORY_LAYOUT") continue;
+			for (auto& [name, define] : ns.defines) {
+				optional<size_t> start = namespaceDefine(ns.name, name);
+				if (name.rfind("SEG_", 0) == 0 && start && *start < cellCount) starts.push_back({name.substr(4), *start});
+			}
+		}
+	}
+	optional<MemoryMonitor::HeapChain> heap;
+	optional<size_t> first = namespaceDefine("heap", "FIRST_CHUNK_HEADER"), end = namespaceDefine("heap", "END_SENTINEL");
+	optional<size_t> overhead = namespaceDefine("chunk", "OVERHEAD"), flagOccupied = namespaceDefine("chunk", "FLAG_OCCUPIED");
+	if (first && end && overhead && flagOccupied && *first <= *end && *end < cellCount) {
+		heap = MemoryMonitor::HeapChain{*first, *end, *overhead, *flagOccupied};
+	}
+	return MemoryMonitor(cellCount, starts, heap);
+}
+/// interprets the program counting executions and memory accesses as flagged, writes their files next to the input
+void interpretInstrumented(Flags& flags) {
+	optional<Profile> profile;
+	optional<MemoryMonitor> monitor;
+	if (flags.profile) profile.emplace(comp->parseCtx.instrs.size());
+	comp->withVM([&](auto& vm) {
+		if (flags.memoryReport) monitor.emplace(memoryMonitor(flags, vm.CELL_COUNT));
+		vm.start(0);
+		execute(vm, comp->parseCtx.instrs, 0, profile ? &*profile : nullptr, monitor ? &*monitor : nullptr);
+		if (monitor) monitor->finish(vm);
+		vm.out->flush();
+	});
+	if (profile) {
+		writeCounts(flags.filePath("counts"), *profile);
+		writeProfileFiles(flags, *profile);
+	}
+	if (monitor) writeMemoryFiles(flags, *monitor);
+}
+/// maps counters dumped by an instrumented executable back to instructions, writes the profile files
+void reportInstrumentCounts(Flags& flags, fs::path countsPath) {
+	Profile profile = readCounts(countsPath, comp->parseCtx.instrs);
+	writeProfileFiles(flags, profile);
+}
+void writeProfileFiles(Flags& flags, Profile& profile) {
+	ofstream reportFile = openOutputFile(flags.filePath("prof"));
+	writeProfileReport(reportFile, profile, comp->parseCtx.instrs, comp->parseCtx.expansions);
+	ofstream foldedFile = openOutputFile(flags.filePath("folded"));
+	writeFoldedStacks(foldedFile, profile, comp->parseCtx.instrs, comp->parseCtx.expansions);
+	*comp->out << "\n[NOTE] profile: \"" << flags.filePath("prof").string() << "\", folded stacks: \"" << flags.filePath("folded").string()
+		<< "\", counts: \"" << flags.filePath("counts").string() << "\"\n";
+	raiseErrors();
+}
+void writeMemoryFiles(Flags& flags, MemoryMonitor& monitor) {
+	ofstream reportFile = openOutputFile(flags.filePath("mem"));
+	writeMemoryReport(reportFile, monitor);
+	writeHeatmap(flags.filePath("heatmap"), monitor, flags.wordBits);
+	*comp->out << "\n[NOTE] memory report: \"" << flags.filePath("mem").string() << "\", heatmap: \"" << flags.filePath("heatmap").string() << "\"\n";
+	raiseErrors();
+}
+/// writes the assembly, starting from the --preinit snapshot if enabled and usable
+void generateExecutable(Flags& flags) {
+	ofstream outFile = openOutputFile(flags.filePath("s"));
+	Preinit preinit{comp->vm, ""};
+	bool preinitialized = false;
+	if (flags.preinit) {
+		PhaseTimer timer("preinit");
+		preinitialized = preinitialize(preinit, comp->parseCtx);
+		if (flags.verbose && preinitialized) *comp->out << "[NOTE] pre-initialized by " << comp->vm.steps << " instrs, starting at instr_" << comp->vm.ip << '\n';
+		else if (flags.verbose) *comp->out << "[NOTE] pre-initialization skipped, the program jumps out of bounds\n";
+	}
+	generate(outFile, comp->parseCtx.instrs, preinitialized ? &preinit : nullptr);
+}
+int run(Flags& flags) {
 	int exitCode = 0;
-	if (flags.interpret) {
-		globalVm = VM();
-		interpret();
+	if (!flags.countsReport.empty()) {
+		reportInstrumentCounts(flags, flags.countsReport);
+	} else if (flags.interpret) {
+		PhaseTimer timer("interpret");
+		comp->withVM([&](auto& vm) {
+			vm.reset();
+			vm.load(comp->parseCtx.data);
+		});
+		if (flags.profile || flags.memoryReport) interpretInstrumented(flags);
+		else interpret();
+		comp->times.runSteps = comp->withVM([](auto& vm) { return vm.steps; });
 	} else {
-		ofstream outFile = openOutputFile(flags.filePath("s"));
-		generate(outFile, parseCtx.instrs);
-
+		generateExecutable(flags);
 		exitCode = compileAndRun(flags);
+		if (flags.instrument && flags.run) reportInstrumentCounts(flags, flags.filePath("counts"));
 	}
-	exit(exitCode);
+	return exitCode;
 }
-int main(int argc, char *argv[]) {
-	flags = processLineArgs(argc, argv);
-	Scope scope;
-	string mainRelPath = tokenizeNewModule(flags.inputPath, scope, true);
-	initParseCtx(flags, mainRelPath);
+size_t tokensSize(list<Token>& tokens) {
+	size_t size = 0;
+	for (Token& token : tokens) size += sizeof(Token) + token.data.capacity() + tokensSize(token.tlist);
+	return size;
+}
+/// prints --time-report to compiler messages, writes its json variant next to the input
+/// - memory sizes are estimates of the biggest structures
+void writeTimeReport(Flags& flags) {
+	if (!flags.timeReport) return;
+	TimeReport& times = comp->times;
+	size_t macrosSize = 0;
+	for (auto& [id, nmspace] : comp->namespaces) {
+		for (auto& [name, mac] : nmspace.macros) macrosSize += tokensSize(mac.body);
+	}
+	size_t instrsSize = comp->parseCtx.instrs.capacity() * sizeof(Instr);
+	for (Instr& instr : comp->parseCtx.instrs) instrsSize += tokensSize(instr.immediates);
+	size_t tokensPeakSize = tokenStats.peakLive * (sizeof(Token) + 2*sizeof(void*)); // with list node pointers
 
-	preprocess(scope);
+	vector<pair<string, unsigned long long>> counters = {
+		{"tokens_created", tokenStats.created},
+		{"macro_expansions", times.macroExpansions},
+		{"ctime_runs", times.ctimeRuns},
+		{"ctime_vm_steps", times.ctimeSteps},
+		{"run_vm_steps", times.runSteps},
+		{"instructions", comp->parseCtx.instrs.size()},
+		{"threaded_jumps", times.threadedJumps},
+	};
+	vector<pair<string, unsigned long long>> memory = {
+		{"tokens_peak", tokensPeakSize},
+		{"macros", macrosSize},
+		{"instructions", instrsSize},
+	};
+	auto ms = [](double seconds) {
+		string s = to_string(seconds * 1000);
+		return s.substr(0, s.find('.') + 4);
+	};
+	auto timesTable = [&](string title, map<string, PhaseTimes>& table) {
+		*comp->out << "[TIME]    wall ms    cpu ms   calls  " << title << '\n';
+		PhaseTimes total;
+		for (auto& [name, phase] : table) {
+			*comp->out << "[TIME] " << padLeft(ms(phase.wall), 10) << padLeft(ms(phase.cpu), 10) << padLeft(to_string(phase.calls), 8) << "  " << name << '\n';
+			total.wall += phase.wall;
+			total.cpu += phase.cpu;
+		}
+		*comp->out << "[TIME] " << padLeft(ms(total.wall), 10) << padLeft(ms(total.cpu), 10) << "          total\n";
+	};
+	*comp->out << '\n';
+	timesTable("phase", times.phases);
+	timesTable("module (tokenize, parse)", times.modules);
+	for (auto& [name, count] : counters) *comp->out << "[TIME] " << name << ": " << count << '\n';
+	for (auto& [name, size] : memory) *comp->out << "[TIME] " << name << "_bytes: " << size << '\n';
 
-	parseCtx.close();
-	if (flags.dump) cout << "\n[NOTE] dump file: \"" << flags.filePath("dump").string() << "\"\n";
-	raiseErrors();
+	if (!flags.timeReportJson) return;
+	fs::path jsonPath = flags.inputPath.parent_path() / (flags.inputPath.stem().string() + ".time.json");
+	ofstream jsonFile = openOutputFile(jsonPath);
+	auto jsonTimes = [&](map<string, PhaseTimes>& table) {
+		string sep = "";
+		for (auto& [name, phase] : table) {
+			jsonFile << sep << "\n\t\t\"" << jsonStringEscaped(name) << "\": {\"wall_ms\": " << ms(phase.wall) << ", \"cpu_ms\": " << ms(phase.cpu) << ", \"calls\": " << phase.calls << "}";
+			sep = ",";
+		}
+	};
+	auto jsonCounts = [&](vector<pair<string, unsigned long long>>& values) {
+		string sep = "";
+		for (auto& [name, value] : values) {
+			jsonFile << sep << "\n\t\t\"" << name << "\": " << value;
+			sep = ",";
+		}
+	};
+	jsonFile << "{\n\t\"file\": \"" << jsonStringEscaped(comp->parseCtx.mainPath.string()) << "\",\n\t\"phases\": {";
+	jsonTimes(times.phases);
+	jsonFile << "\n\t},\n\t\"modules\": {";
+	jsonTimes(times.modules);
+	jsonFile << "\n\t},\n\t\"counters\": {";
+	jsonCounts(counters);
+	jsonFile << "\n\t},\n\t\"memory_bytes\": {";
+	jsonCounts(memory);
+	jsonFile << "\n\t}\n}\n";
+	*comp->out << "[NOTE] time report: \"" << jsonPath.string() << "\"\n";
+}
+// library API ------------------------------------------
+// build with MASFIX_NO_MAIN defined to embed the compiler and the VM into another program
+
+/// compiled program, immutable and shareable between threads running it
+struct Program {
+	vector<Instr> instrs;
+	map<unsigned, unsigned> data; // initial memory
+	int wordBits = 16; // runs on VM / VM32
+};
+/// compiles the program at flags.inputPath, throws CompilationFailed on errors
+/// - compiler messages and ctime output go to out, errors to err
+Program compileProgram(Flags flags, ostream& out=cout, ostream& err=cerr) {
+	populateIncludePaths(flags);
+	unique_ptr<Compilation> compilation = make_unique<Compilation>(flags);
+	Compilation* prevComp = comp;
+	comp = compilation.get();
+	comp->out = &out;
+	comp->err = &err;
+	comp->vm.out = &out;
+	Program program;
+	try {
+		Scope scope;
+		compile(flags, scope);
+		program.instrs = comp->parseCtx.instrs;
+		program.data = comp->parseCtx.data;
+		program.wordBits = flags.wordBits;
+	} catch (CompilationFailed& failed) {
+		comp = prevComp;
+		throw;
+	}
+	comp = prevComp;
+	return program;
+}
+/// returns the next chunk of program input, an empty one at the end of input
+/// - the chunk must stay valid until the next call or the end of the run
+typedef function<pair<const char*, size_t>()> ReadCallback;
+/// receives chunks of program output, valid only during the call
+typedef function<void(const char*, size_t)> WriteCallback;
+
+/// stream buffer passing VM I/O to caller callbacks
+/// - input chunks are read in place, output is flushed in STDOUT_BUFF_SIZE chunks
+struct CallbackStreambuf : streambuf {
+	ReadCallback read;
+	WriteCallback write;
+	char outBuff[STDOUT_BUFF_SIZE];
+
+	CallbackStreambuf(ReadCallback read, WriteCallback write) : read(read), write(write) {
+		setp(outBuff, outBuff + STDOUT_BUFF_SIZE);
+	}
+	int_type underflow() override {
+		if (!read) return traits_type::eof();
+		auto [data, len] = read();
+		if (!len) return traits_type::eof();
+		char* chunk = const_cast<char*>(data); // get area is never written to
+		setg(chunk, chunk, chunk + len);
+		return traits_type::to_int_type(*gptr());
+	}
+	int_type overflow(int_type c) override {
+		sync();
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+	int sync() override {
+		if (pptr() != pbase() && write) write(pbase(), pptr() - pbase());
+		setp(outBuff, outBuff + STDOUT_BUFF_SIZE);
+		return 0;
+	}
+};
+/// resets the VM and runs the program on it, I/O goes through the callbacks
+/// @param budget: max number of executed instructions, 0 for unlimited
+template<typename Word>
+RunStatus runProgram(Program const& program, BasicVM<Word>& vm, ReadCallback read, WriteCallback write, unsigned long long budget=0) {
+	if (program.wordBits != 8 * sizeof(Word)) return RSwordBitsMismatch;
+	CallbackStreambuf buff(read, write);
+	istream in(&buff);
+	ostream out(&buff);
+	vm.reset();
+	vm.load(program.data);
+	vm.in = &in;
+	vm.out = &out;
+	RunStatus status = execute(vm, program.instrs, budget);
+	out.flush();
+	vm.in = &cin;
+	vm.out = &cout;
+	return status;
+}
+/// preallocated VMs of both word sizes reused between runs, can be shared between threads
+struct VMPool {
+	mutex poolMutex;
+	vector<unique_ptr<VM>> idle;
+	vector<unique_ptr<VM32>> idle32; // allocated only once needed, each reserves 16 GiB of address space
+
+	VMPool(int size=0) {
+		for (int i = 0; i < size; ++i) idle.push_back(make_unique<VM>());
+	}
+	template<typename Word>
+	vector<unique_ptr<BasicVM<Word>>>& idleOf() {
+		if constexpr (is_same_v<Word, unsigned>) return idle32;
+		else return idle;
+	}
+	/// takes an idle VM, allocates a new one only if there is none
+	template<typename Word=unsigned short>
+	unique_ptr<BasicVM<Word>> acquire() {
+		lock_guard<mutex> lock(poolMutex);
+		vector<unique_ptr<BasicVM<Word>>>& vms = idleOf<Word>();
+		if (vms.empty()) return make_unique<BasicVM<Word>>();
+		unique_ptr<BasicVM<Word>> vm = move(vms.back());
+		vms.pop_back();
+		return vm;
+	}
+	template<typename Word>
+	void release(unique_ptr<BasicVM<Word>> vm) {
+		lock_guard<mutex> lock(poolMutex);
+		idleOf<Word>().push_back(move(vm));
+	}
+	/// calls f with an idle VM of the word size, returns it to the pool afterwards
+	template<typename F>
+	auto withVM(int wordBits, F f) {
+		if (wordBits == 32) return withIdle<unsigned>(f);
+		return withIdle<unsigned short>(f);
+	}
+	template<typename Word, typename F>
+	auto withIdle(F f) {
+		struct Lease { // released even if f throws
+			VMPool& pool;
+			unique_ptr<BasicVM<Word>> vm;
+			~Lease() { pool.release(move(vm)); }
+		} lease{*this, acquire<Word>()};
+		return f(*lease.vm);
+	}
+};
+/// runs the program on an idle VM of its word size
+RunStatus runProgram(Program const& program, VMPool& pool, ReadCallback read, WriteCallback write, unsigned long long budget=0) {
+	return pool.withVM(program.wordBits, [&](auto& vm) { return runProgram(program, vm, read, write, budget); });
+}
+// resident modes ---------------------------------------
+/// last compilation of a program kept in memory by resident modes
+struct ResidentBuild {
+	vector<pair<fs::path, fs::file_time_type>> modules; // with modification times at compilation
+	Program program;
+	bool native = false;
+	bool failed = true;
+
+	bool upToDate() {
+		for (auto& [path, mtime] : modules) {
+			if (!fs::exists(path) || fs::last_write_time(path) != mtime) return false;
+		}
+		return !modules.empty();
+	}
+	void addModules(vector<fs::path> paths) {
+		lock_guard<mutex> lock(moduleCacheMutex);
+		for (fs::path& path : paths) {
+			modules.push_back(pair(path, moduleCache.count(path) ? moduleCache[path].mtime : fs::last_write_time(path)));
+		}
+	}
+};
+map<fs::path, ResidentBuild> residentBuilds;
+
+/// recompiles the program only if any of its modules changed since the last build
+ResidentBuild& residentCompile(Flags& flags) {
+	ResidentBuild& build = residentBuilds[flags.inputPath];
+	bool native = !flags.interpret;
+	if (!build.failed && build.upToDate() && build.native == native && (!native || fs::exists(flags.filePath("exe")))) {
+		if (flags.verbose) *comp->out << "[NOTE] up to date: " << flags.inputPath.string() << '\n';
+		return build;
+	}
+	build = ResidentBuild();
+	build.native = native;
+	Scope scope;
+	try {
+		compile(flags, scope);
+		if (native) {
+			generateExecutable(flags);
+			assembleAndLink(flags);
+		}
+	} catch (CompilationFailed& failed) {
+		build.addModules(scope.modulePaths());
+		throw;
+	}
+	build.addModules(scope.modulePaths());
+	build.program.instrs = comp->parseCtx.instrs;
+	build.program.data = comp->parseCtx.data;
+	build.program.wordBits = flags.wordBits;
+	build.failed = false;
+	return build;
+}
+/// runs the request in a fresh compilation
+/// @param input: stdin of interpreted program
+int residentRun(Flags& flags, istream& input) {
+	unique_ptr<Compilation> compilation = make_unique<Compilation>(flags);
+	comp = compilation.get();
+	comp->vm.in = &input;
+	int exitCode = 0;
+	try {
+		ResidentBuild& build = residentCompile(flags);
+		if (flags.interpret) {
+			comp->withVM([&](auto& vm) {
+				vm.reset();
+				vm.load(build.program.data);
+				execute(vm, build.program.instrs);
+				vm.out->flush();
+			});
+		} else {
+			exitCode = runExecutable(flags);
+		}
+	} catch (CompilationFailed& failed) {
+		exitCode = failed.exitCode;
+	}
+	writeTimeReport(flags);
+	comp = nullptr;
+	return exitCode;
+}
+/// handles requests from stdin, one per line, answers each with '[DONE] <exit-code>' line
+void serve(Flags baseFlags) {
+	string line;
+	while (getline(cin, line)) {
+		stringstream request(line);
+		string kind, file, inputFile;
+		request >> kind >> file >> inputFile;
+		if (kind == "") continue;
+		if (kind == "quit") break;
+		int exitCode = 1;
+		if (kind != "compile" && kind != "run" && kind != "interpret") {
+			cerr << "ERROR: Unknown request" << errorQuoted(kind) << '\n';
+		} else if (!fs::is_regular_file(file)) {
+			cerr << "ERROR: Input file not found" << errorQuoted(file == "" ? "\"\"" : file) << '\n';
+		} else if (inputFile != "" && !fs::is_regular_file(inputFile)) {
+			cerr << "ERROR: Stdin file not found" << errorQuoted(inputFile) << '\n';
+		} else {
+			Flags flags = baseFlags;
+			flags.inputPath = fs::canonical(file);
+			flags.run = kind != "compile";
+			flags.interpret = kind == "interpret";
+			populateIncludePaths(flags);
+			ifstream input;
+			if (inputFile != "") input.open(inputFile);
+			exitCode = residentRun(flags, input);
+		}
+		cerr.flush();
+		cout << "\n[DONE] " << exitCode << endl;
+	}
+}
+/// reruns the program whenever any of its modules changes
+void watch(Flags flags) {
+	while (true) {
+		int exitCode = residentRun(flags, cin);
+		cerr.flush();
+		cout << "\n[WATCH] exit code " << exitCode << ", waiting for changes" << endl;
+		while (residentBuilds[flags.inputPath].upToDate()) {
+			this_thread::sleep_for(chrono::milliseconds(200));
+		}
+	}
+}
+// batch mode -------------------------------------------
+/// single input of batch mode, compiled on its own thread
+struct BatchJob {
+	unique_ptr<Compilation> compilation;
+	stringstream out;
+	stringstream err;
+	istringstream noInput;
+	int exitCode = 0;
 
-	run(flags);
+	BatchJob(Flags flags) {
+		compilation = make_unique<Compilation>(flags);
+		compilation->vm.in = &noInput;
+		compilation->vm.out = &out;
+		compilation->out = &out;
+		compilation->err = &err;
+	}
+	void compileJob() {
+		comp = compilation.get();
+		Flags& flags = comp->flags;
+		try {
+			Scope scope;
+			compile(flags, scope);
+			if (flags.interpret) {
+				run(flags);
+			} else {
+				generateExecutable(flags);
+				assembleAndLink(flags);
+			}
+		} catch (CompilationFailed& failed) {
+			exitCode = failed.exitCode;
+		}
+		writeTimeReport(flags);
+		comp = nullptr;
+	}
+};
+/// compiles all inputs concurrently, tokenized modules are shared between jobs
+/// - outputs are reported in the input order, executables are run sequentially afterwards
+int runBatch(Flags& baseFlags) {
+	vector<unique_ptr<BatchJob>> jobs;
+	for (fs::path& path : baseFlags.batchPaths) {
+		Flags flags = baseFlags;
+		flags.inputPath = path;
+		populateIncludePaths(flags);
+		jobs.push_back(make_unique<BatchJob>(flags));
+	}
+	atomic<size_t> nextJob = 0;
+	vector<thread> workers;
+	for (int i = 0; i < min((size_t)baseFlags.jobs, jobs.size()); ++i) {
+		workers.push_back(thread([&]() {
+			for (size_t idx = nextJob++; idx < jobs.size(); idx = nextJob++) {
+				jobs[idx]->compileJob();
+			}
+		}));
+	}
+	for (thread& worker : workers) worker.join();
+
+	int exitCode = 0;
+	for (unique_ptr<BatchJob>& job : jobs) {
+		comp = job->compilation.get();
+		if (baseFlags.verbose) cout << "[BATCH] " << comp->flags.inputPath.string() << '\n';
+		cout << job->out.str();
+		cerr << job->err.str();
+		comp->out = &cout;
+		comp->err = &cerr;
+		if (!job->exitCode && !comp->flags.interpret) job->exitCode = runExecutable(comp->flags);
+		if (!exitCode) exitCode = job->exitCode;
+		comp = nullptr;
+	}
+	return exitCode;
+}
+#ifndef MASFIX_NO_MAIN
+int main(int argc, char *argv[]) {
+	Flags flags = processLineArgs(argc, argv);
+	TokenStats::enabled = flags.timeReport;
+	useModuleCache = flags.serve || flags.watch || flags.jobs;
+	if (flags.serve) serve(flags);
+	else if (flags.watch) watch(flags);
+	else if (flags.jobs) exit(runBatch(flags));
+	else {
+		unique_ptr<Compilation> compilation = make_unique<Compilation>(flags);
+		comp = compilation.get();
+		int exitCode;
+		try {
+			Scope scope;
+			compile(flags, scope);
+			exitCode = run(flags);
+		} catch (CompilationFailed& failed) {
+			exitCode = failed.exitCode;
+		}
+		writeTimeReport(flags);
+		exit(exitCode);
+	}
 }
+#endif
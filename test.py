@@ -44,12 +44,12 @@ def runCommand(command, stdin: str, timeout=None) -> dict:
 	stderr = stderr.decode().replace('\r', '')
 	return {'returncode': process.returncode, 'stdout': stdout, 'stderr': stderr}
 def parseTestcaseDesc(desc: str):
-	expected = {'stdout': '', 'stderr': '', 'stdin': ''}
+	expected = {'stdout': '', 'stderr': '', 'stdin': '', 'args': '', 'mem': ''}
 	while ':' in desc:
 		desc = desc[desc.find(':')+1:]
 		line = desc.split('\n', maxsplit=1)[0]
 		desc = desc[len(line):]
-		for fieldType, fieldName in [(int, 'returncode'), (str, 'stdout'), (str, 'stderr'), (str, 'stdin')]:
+		for fieldType, fieldName in [(int, 'returncode'), (str, 'stdout'), (str, 'stderr'), (str, 'stdin'), (str, 'args'), (str, 'mem')]:
 			if not re.match(f'{fieldName} \\d+', line): continue
 			num = int(line.split(' ')[1])
 			if fieldType == int:
@@ -77,7 +77,7 @@ def getTestcaseDesc(test: Path, update=False) -> dict:
 	path = _getTestcasePath(test)
 	if update:
 		if not os.path.exists(path):
-			return {'returncode': 0, 'stdout': '', 'stderr': '', 'stdin': ''}
+			return {'returncode': 0, 'stdout': '', 'stderr': '', 'stdin': '', 'args': '', 'mem': ''}
 	else:
 		check(os.path.exists(path), 'Missing test case desciption', quoted(path))
 	with open(path, 'r') as testcase:
@@ -87,7 +87,7 @@ def getTestcaseDesc(test: Path, update=False) -> dict:
 	except TestcaseException as e:
 		if update:
 			print('[NOTE] Using default testcase description\n')
-			return {'returncode': 0, 'stdout': '', 'stderr': '', 'stdin': ''}
+			return {'returncode': 0, 'stdout': '', 'stderr': '', 'stdin': '', 'args': '', 'mem': ''}
 		raise e
 # updates -----------------------------------
 def askWhetherToDo(doWhat: str) -> bool:
@@ -97,7 +97,7 @@ def askWhetherToDo(doWhat: str) -> bool:
 def updateFileOutput(file: Path, verbose=True):
 	print('[UPDATING]', file)
 	original = getTestcaseDesc(file, update=True)
-	ran = runFile(file, original['stdin'], False)
+	ran = runFile(file, original['stdin'], False, original['args'])
 	if verbose:
 		print()
 		print('[NOTE] returncode:', ran['returncode'])
@@ -106,6 +106,7 @@ def updateFileOutput(file: Path, verbose=True):
 		print('[NOTE] stderr:')
 		print(ran['stderr'], end='')
 	ran['stdin'] = original['stdin']
+	ran['args'] = original['args']
 	saveDesc(file, ran)
 def updateInput(file: Path):
 	print('[INPUT]', file)
@@ -126,9 +127,20 @@ def updateInput(file: Path):
 		updateFileOutput(file)
 	
 # test ------------------------------------------
-def runFile(path, stdin, interpret, timeout=5.0) -> dict:
+def runFile(path, stdin, interpret, args='', timeout=5.0) -> dict:
 	if 'basic-test.mx' in str(path): timeout = 30 # NOTE avoid timeouts when Github actions runs the FIRST testcase
-	return runCommand(['Masfix', '-r', str(path)] + ['-I'] * interpret, stdin, timeout)
+	ran = runCommand(['Masfix', '-r', str(path)] + ['-I'] * interpret + args.split(), stdin, timeout)
+	ran['stdout'] = ran['stdout'].replace(str(Path(path).resolve().parent) + os.sep, '') # reported file paths are absolute
+	ran['mem'] = takeMemoryReport(Path(path))
+	return ran
+def takeMemoryReport(path: Path) -> str:
+	"""contents of the --memory-report written by the run, the report files are removed"""
+	if not path.with_suffix('.mem').exists(): return ''
+	with open(path.with_suffix('.mem'), 'r') as f:
+		report = f.read()
+	for ext in ['.mem', '.heatmap']:
+		path.with_suffix(ext).unlink(missing_ok=True)
+	return report
 
 def checkTestResult(expected: dict, ran: dict, keyName: str):
 	if expected[keyName] == ran[keyName]: return True
@@ -140,12 +152,22 @@ def checkTestResult(expected: dict, ran: dict, keyName: str):
 	return False
 def runTest(path: Path, interpret: bool) -> bool:
 	expected = getTestcaseDesc(path)
-	ran = runFile(path, expected['stdin'], interpret)
+	ran = runFile(path, expected['stdin'], interpret, expected['args'])
 	res = checkTestResult(expected, ran, 'stdout')
 	if not interpret or 'jmp destination out of bounds' not in expected['stderr']:
 		res &= checkTestResult(expected, ran, 'returncode')
 		res &= checkTestResult(expected, ran, 'stderr')
+	res &= checkTestResult(expected, ran, 'mem')
 	return res
+def runApiTest(path: Path) -> bool:
+	"""builds and runs the C++ program next to the test, which embeds Masfix through its library API"""
+	source, exe = path.with_suffix('.cpp'), path.with_suffix('')
+	comm = ['g++', '-std=c++17', str(source), '-o', str(exe)]
+	print('[CMD]', *comm)
+	check(runCommand(comm, '')['returncode'] == 0, 'g++ error')
+	ran = runCommand([str(exe)], '', timeout=30)
+	print(ran['stdout'], end='')
+	return checkTestResult({'returncode': 0}, ran, 'returncode')
 def _handleTestResult(failedTests: list[Path]):
 	print()
 	if not len(failedTests):
@@ -181,6 +203,7 @@ def runTests(dir: Path, quick: bool):
 			print('[TESTING]', path)
 			passed = runTest(path, True)
 			if (not quick): passed = passed and runTest(path, False)
+			if (not quick and path.with_suffix('.cpp').exists()): passed = passed and runApiTest(path)
 		except TestcaseException:
 			passed = False
 			print()
@@ -192,11 +215,15 @@ def saveDesc(file: Path, desc):
 	stdout = desc['stdout']
 	stderr = desc['stderr']
 	stdin = desc['stdin']
+	args = desc['args']
+	mem = desc['mem']
 	with open(_getTestcasePath(file, createFolders=True), 'w') as f:
 		f.write(f':returncode {code}\n\n')
 		if stdout: f.write(f':stdout {len(stdout)}\n{stdout}\n\n')
 		if stderr: f.write(f':stderr {len(stderr)}\n{stderr}\n\n')
 		if stdin: f.write(f':stdin {len(stdin)}\n{stdin}\n\n')
+		if args: f.write(f':args {len(args)}\n{args}\n\n')
+		if mem: f.write(f':mem {len(mem)}\n{mem}\n\n')
 
 # modes --------------------------------------
 def processFileArg(arg) -> Path:
@@ -255,7 +282,8 @@ def usage():
 """Usage: test.py <mode>
 modes:
 	q, quick               - test all by only interpretting (also the default behavior)
-	r, run                 - test all in 'tests', 'examples' by compilation and interpretting
+	r, run                 - test all in 'tests', 'examples' by compilation and interpretting,
+	                         also builds and runs the library API tests (<test>.cpp)
 	u, update              - update all tests output
 	update output <test>   - update the expected output of <test> to the actual output
 	update input <test>    - update the stdin passed to <test>"""
@@ -0,0 +1,57 @@
+// embedding API test - compiles embedding.mx for both word sizes and runs it on pooled VMs
+// built & run from the repository root by test.py, exit code is the number of failed checks
+#define MASFIX_NO_MAIN
+#include "../../Masfix.cpp"
+
+int failures = 0;
+
+void expect(bool cond, string what) {
+	if (cond) return;
+	cout << "[FAILED] " << what << '\n';
+	failures++;
+}
+/// runs the program with input on vm, returns its output
+template<typename VMType>
+string runOn(Program const& program, VMType& vm, string input, RunStatus expected, unsigned long long budget=0) {
+	string output;
+	bool inputRead = false;
+	ReadCallback read = [&]() {
+		if (inputRead) return pair<const char*, size_t>(nullptr, 0);
+		inputRead = true;
+		return pair<const char*, size_t>(input.data(), input.size());
+	};
+	WriteCallback write = [&](const char* data, size_t len) { output.append(data, len); };
+	RunStatus status = runProgram(program, vm, read, write, budget);
+	expect(status == expected, to_string(program.wordBits) + " bits: status " + to_string(status) + ", expected " + to_string(expected));
+	return output;
+}
+int main() {
+	VMPool pool;
+	map<int, string> largestWord = {{16, "65535"}, {32, "4294967295"}};
+	for (auto [wordBits, largest] : largestWord) {
+		string bits = to_string(wordBits) + " bits: ";
+		Flags flags;
+		flags.inputPath = fs::canonical("tests/embedding/embedding.mx");
+		flags.wordBits = wordBits;
+		Program program = compileProgram(flags);
+		expect(program.wordBits == wordBits, bits + "program word size");
+
+		for (string input : {"41\n", "9\n"}) { // pooled VMs are reset between runs
+			string output = runOn(program, pool, input, RSfinished);
+			string expected = to_string(stoi(input) + 1) + " " + largest + "\n";
+			expect(output == expected, bits + "output '" + output + "', expected '" + expected + "'");
+		}
+		string partial = runOn(program, pool, "41\n", RSbudgetExhausted, 3);
+		expect(partial == "42", bits + "output within budget '" + partial + "'");
+
+		if (wordBits == 16) {
+			VM32 vm32;
+			expect(runOn(program, vm32, "41\n", RSwordBitsMismatch) == "", bits + "output on the 32-bit VM");
+		} else {
+			VM vm;
+			expect(runOn(program, vm, "41\n", RSwordBitsMismatch) == "", bits + "output on the 16-bit VM");
+		}
+	}
+	if (!failures) cout << "[OK] embedding API\n";
+	return failures;
+}